@@ -0,0 +1,1010 @@
+/* See LICENSE file for copyright and license details. */
+#include "argon2.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libblake.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define X86_KERNELS
+# include <immintrin.h>
+#endif
+
+/* without atomics, threads that are waiting always sleep */
+#if defined(__GNUC__)
+# define SPINS 10000
+# define LOAD(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+# define STORE(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#else
+# define SPINS 0
+# define LOAD(P) (*(P))
+# define STORE(P, V) (*(P) = (V))
+#endif
+
+#ifdef X86_KERNELS
+# define RELAX() _mm_pause()
+#else
+# define RELAX() ((void)0)
+#endif
+
+
+#define BLOCK_WORDS 128
+#define BLOCK_SIZE (BLOCK_WORDS * 8)
+#define SYNC_POINTS 4
+#define HASH_BLOCK 128
+#define HASH_SIZE 64
+#define MAX_LENGTH 0xFFFFFFFFUL
+#define MAX_LANES 0xFFFFFFUL
+
+
+struct block {
+	uint64_t v[BLOCK_WORDS];
+};
+
+struct kernel {
+	const char *name;
+	int (*supported)(void);
+	void (*permute)(uint64_t r[BLOCK_WORDS]);
+};
+
+struct instance {
+	struct block *memory;
+	void (*permute)(uint64_t r[BLOCK_WORDS]);
+	uint_least32_t passes;
+	uint_least32_t lanes;
+	uint_least32_t lane_length;
+	uint_least32_t segment_length;
+	uint_least32_t nblocks;
+	int type;
+	int version;
+	size_t max_threads;
+	size_t nthreads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t waiting;
+	unsigned int phase;
+	size_t pending;
+	volatile sig_atomic_t *cancelled;
+	int stop;
+};
+
+struct worker {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int posted;
+	struct instance *instance;
+	size_t index;
+	struct worker *next;
+};
+
+struct hasher {
+	struct libblake_blake2b_state state;
+	unsigned char block[HASH_BLOCK];
+	size_t len;
+	size_t digest_len;
+};
+
+
+/* BLAKE2b round without message words, with the multiplication added by Argon2 */
+
+#define ROTR64(X, N) (((X) >> (N)) | ((X) << (64 - (N))))
+#define BLAMKA(A, B) ((A) + (B) + 2 * ((A) & 0xFFFFFFFFU) * ((B) & 0xFFFFFFFFU))
+
+#define G(A, B, C, D)\
+	do {\
+		A = BLAMKA(A, B);\
+		D = ROTR64(D ^ A, 32);\
+		C = BLAMKA(C, D);\
+		B = ROTR64(B ^ C, 24);\
+		A = BLAMKA(A, B);\
+		D = ROTR64(D ^ A, 16);\
+		C = BLAMKA(C, D);\
+		B = ROTR64(B ^ C, 63);\
+	} while (0)
+
+
+/* The permutation of a block applies the round to each row of 16 words,
+ * and then to each column, where a column is 8 pairs of words with 16
+ * words between each pair. Word k of a round is r[k / 2 * step + k % 2],
+ * with step 2 for rows and 16 for columns. */
+
+static void
+round_portable(uint64_t *r, size_t step)
+{
+	uint64_t v[16];
+	size_t k;
+
+	for (k = 0; k < 16; k++)
+		v[k] = r[k / 2 * step + k % 2];
+	G(v[0], v[4], v[8], v[12]);
+	G(v[1], v[5], v[9], v[13]);
+	G(v[2], v[6], v[10], v[14]);
+	G(v[3], v[7], v[11], v[15]);
+	G(v[0], v[5], v[10], v[15]);
+	G(v[1], v[6], v[11], v[12]);
+	G(v[2], v[7], v[8], v[13]);
+	G(v[3], v[4], v[9], v[14]);
+	for (k = 0; k < 16; k++)
+		r[k / 2 * step + k % 2] = v[k];
+}
+
+
+static void
+permute_portable(uint64_t r[BLOCK_WORDS])
+{
+	size_t i;
+	for (i = 0; i < 8; i++)
+		round_portable(&r[16 * i], 2);
+	for (i = 0; i < 8; i++)
+		round_portable(&r[2 * i], 16);
+}
+
+
+#ifdef X86_KERNELS
+
+/* The vector kernels run the four column steps of the round at once, with
+ * a, b, c, and d each holding four words, and then rotate b, c, and d so that
+ * the diagonal steps line up, and back again afterwards. With AVX-512, two
+ * rounds are run at once, one in each 256-bit half of the registers. */
+
+#define LOAD128(P) _mm_loadu_si128((const void *)(P))
+#define STORE128(P, X) _mm_storeu_si128((void *)(P), (X))
+
+
+static int
+have_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128i
+blamka_sse2(__m128i a, __m128i b)
+{
+	__m128i p = _mm_mul_epu32(a, b);
+	return _mm_add_epi64(_mm_add_epi64(a, b), _mm_add_epi64(p, p));
+}
+
+
+#define ROTR_SSE2(X, N) _mm_or_si128(_mm_srli_epi64((X), (N)), _mm_slli_epi64((X), 64 - (N)))
+#define SHUF_SSE2(X, Y) _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(X), _mm_castsi128_pd(Y), 1))
+
+#define G_SSE2(A, B, C, D)\
+	do {\
+		A = blamka_sse2(A, B);\
+		D = _mm_shuffle_epi32(_mm_xor_si128(D, A), _MM_SHUFFLE(2, 3, 0, 1));\
+		C = blamka_sse2(C, D);\
+		B = _mm_xor_si128(B, C);\
+		B = ROTR_SSE2(B, 24);\
+		A = blamka_sse2(A, B);\
+		D = _mm_xor_si128(D, A);\
+		D = ROTR_SSE2(D, 16);\
+		C = blamka_sse2(C, D);\
+		B = _mm_xor_si128(B, C);\
+		B = _mm_xor_si128(_mm_srli_epi64(B, 63), _mm_add_epi64(B, B));\
+	} while (0)
+
+
+__attribute__((target("sse2")))
+static void
+round_sse2(uint64_t *r, size_t step)
+{
+	__m128i a0, a1, b0, b1, c0, c1, d0, d1, t;
+
+	a0 = LOAD128(&r[0 * step]);
+	a1 = LOAD128(&r[1 * step]);
+	b0 = LOAD128(&r[2 * step]);
+	b1 = LOAD128(&r[3 * step]);
+	c0 = LOAD128(&r[4 * step]);
+	c1 = LOAD128(&r[5 * step]);
+	d0 = LOAD128(&r[6 * step]);
+	d1 = LOAD128(&r[7 * step]);
+
+	G_SSE2(a0, b0, c0, d0);
+	G_SSE2(a1, b1, c1, d1);
+
+	t = b0, b0 = SHUF_SSE2(b0, b1), b1 = SHUF_SSE2(b1, t);
+	t = c0, c0 = c1, c1 = t;
+	t = d0, d0 = SHUF_SSE2(d1, t), d1 = SHUF_SSE2(t, d1);
+
+	G_SSE2(a0, b0, c0, d0);
+	G_SSE2(a1, b1, c1, d1);
+
+	t = b0, b0 = SHUF_SSE2(b1, t), b1 = SHUF_SSE2(t, b1);
+	t = c0, c0 = c1, c1 = t;
+	t = d0, d0 = SHUF_SSE2(d0, d1), d1 = SHUF_SSE2(d1, t);
+
+	STORE128(&r[0 * step], a0);
+	STORE128(&r[1 * step], a1);
+	STORE128(&r[2 * step], b0);
+	STORE128(&r[3 * step], b1);
+	STORE128(&r[4 * step], c0);
+	STORE128(&r[5 * step], c1);
+	STORE128(&r[6 * step], d0);
+	STORE128(&r[7 * step], d1);
+}
+
+
+__attribute__((target("sse2")))
+static void
+permute_sse2(uint64_t r[BLOCK_WORDS])
+{
+	size_t i;
+	for (i = 0; i < 8; i++)
+		round_sse2(&r[16 * i], 2);
+	for (i = 0; i < 8; i++)
+		round_sse2(&r[2 * i], 16);
+}
+
+
+static int
+have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i
+blamka_avx2(__m256i a, __m256i b)
+{
+	__m256i p = _mm256_mul_epu32(a, b);
+	return _mm256_add_epi64(_mm256_add_epi64(a, b), _mm256_add_epi64(p, p));
+}
+
+
+#define G_AVX2(A, B, C, D)\
+	do {\
+		A = blamka_avx2(A, B);\
+		D = _mm256_shuffle_epi32(_mm256_xor_si256(D, A), _MM_SHUFFLE(2, 3, 0, 1));\
+		C = blamka_avx2(C, D);\
+		B = _mm256_shuffle_epi8(_mm256_xor_si256(B, C), rotr24);\
+		A = blamka_avx2(A, B);\
+		D = _mm256_shuffle_epi8(_mm256_xor_si256(D, A), rotr16);\
+		C = blamka_avx2(C, D);\
+		B = _mm256_xor_si256(B, C);\
+		B = _mm256_xor_si256(_mm256_srli_epi64(B, 63), _mm256_add_epi64(B, B));\
+	} while (0)
+
+#define LOAD_AVX2(J)\
+	_mm256_inserti128_si256(_mm256_castsi128_si256(LOAD128(&r[2 * (J) * step])),\
+	                        LOAD128(&r[(2 * (J) + 1) * step]), 1)
+
+#define STORE_AVX2(J, X)\
+	do {\
+		STORE128(&r[2 * (J) * step], _mm256_castsi256_si128(X));\
+		STORE128(&r[(2 * (J) + 1) * step], _mm256_extracti128_si256((X), 1));\
+	} while (0)
+
+
+__attribute__((target("avx2")))
+static void
+round_avx2(uint64_t *r, size_t step)
+{
+	const __m256i rotr24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+	                                        3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i rotr16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+	                                        2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i a, b, c, d;
+
+	a = LOAD_AVX2(0);
+	b = LOAD_AVX2(1);
+	c = LOAD_AVX2(2);
+	d = LOAD_AVX2(3);
+
+	G_AVX2(a, b, c, d);
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+	G_AVX2(a, b, c, d);
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+
+	STORE_AVX2(0, a);
+	STORE_AVX2(1, b);
+	STORE_AVX2(2, c);
+	STORE_AVX2(3, d);
+}
+
+
+__attribute__((target("avx2")))
+static void
+permute_avx2(uint64_t r[BLOCK_WORDS])
+{
+	size_t i;
+	for (i = 0; i < 8; i++)
+		round_avx2(&r[16 * i], 2);
+	for (i = 0; i < 8; i++)
+		round_avx2(&r[2 * i], 16);
+}
+
+
+static int
+have_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+
+__attribute__((target("avx512f")))
+static inline __m512i
+blamka_avx512(__m512i a, __m512i b)
+{
+	__m512i p = _mm512_mul_epu32(a, b);
+	return _mm512_add_epi64(_mm512_add_epi64(a, b), _mm512_add_epi64(p, p));
+}
+
+
+#define G_AVX512(A, B, C, D)\
+	do {\
+		A = blamka_avx512(A, B);\
+		D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 32);\
+		C = blamka_avx512(C, D);\
+		B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 24);\
+		A = blamka_avx512(A, B);\
+		D = _mm512_ror_epi64(_mm512_xor_si512(D, A), 16);\
+		C = blamka_avx512(C, D);\
+		B = _mm512_ror_epi64(_mm512_xor_si512(B, C), 63);\
+	} while (0)
+
+#define LOAD_AVX512(J)\
+	_mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(\
+		_mm512_castsi128_si512(LOAD128(&x[2 * (J) * step])),\
+		LOAD128(&x[(2 * (J) + 1) * step]), 1),\
+		LOAD128(&y[2 * (J) * step]), 2),\
+		LOAD128(&y[(2 * (J) + 1) * step]), 3)
+
+#define STORE_AVX512(J, V)\
+	do {\
+		STORE128(&x[2 * (J) * step], _mm512_extracti32x4_epi32((V), 0));\
+		STORE128(&x[(2 * (J) + 1) * step], _mm512_extracti32x4_epi32((V), 1));\
+		STORE128(&y[2 * (J) * step], _mm512_extracti32x4_epi32((V), 2));\
+		STORE128(&y[(2 * (J) + 1) * step], _mm512_extracti32x4_epi32((V), 3));\
+	} while (0)
+
+
+__attribute__((target("avx512f")))
+static void
+rounds_avx512(uint64_t *x, uint64_t *y, size_t step)
+{
+	__m512i a, b, c, d;
+
+	a = LOAD_AVX512(0);
+	b = LOAD_AVX512(1);
+	c = LOAD_AVX512(2);
+	d = LOAD_AVX512(3);
+
+	G_AVX512(a, b, c, d);
+	b = _mm512_permutex_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));
+	c = _mm512_permutex_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm512_permutex_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));
+	G_AVX512(a, b, c, d);
+	b = _mm512_permutex_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));
+	c = _mm512_permutex_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));
+	d = _mm512_permutex_epi64(d, _MM_SHUFFLE(0, 3, 2, 1));
+
+	STORE_AVX512(0, a);
+	STORE_AVX512(1, b);
+	STORE_AVX512(2, c);
+	STORE_AVX512(3, d);
+}
+
+
+__attribute__((target("avx512f")))
+static void
+permute_avx512(uint64_t r[BLOCK_WORDS])
+{
+	size_t i;
+	for (i = 0; i < 8; i += 2)
+		rounds_avx512(&r[16 * i], &r[16 * (i + 1)], 2);
+	for (i = 0; i < 8; i += 2)
+		rounds_avx512(&r[2 * i], &r[2 * (i + 1)], 16);
+}
+
+#endif
+
+
+/* The first supported kernel is used, the portable kernel must be last */
+static const struct kernel kernels[] = {
+#ifdef X86_KERNELS
+	{"avx512", have_avx512, permute_avx512},
+	{"avx2", have_avx2, permute_avx2},
+	{"sse2", have_sse2, permute_sse2},
+#endif
+	{"portable", NULL, permute_portable}
+};
+
+static const struct kernel *kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+static void
+select_kernel(void)
+{
+	const char *name = NULL;
+	size_t i;
+
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+#endif
+
+	/* a kernel can be forced for testing, unless it is a set-ID process, but only if
+	 * the CPU supports it, otherwise the best kernel for the CPU is selected */
+	if (getuid() == geteuid() && getgid() == getegid())
+		name = getenv("KEY2ROOT_ARGON2_KERNEL");
+	for (i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+		if (kernels[i].supported && !kernels[i].supported())
+			continue;
+		if (!kernel)
+			kernel = &kernels[i];
+		if (name && !strcmp(name, kernels[i].name)) {
+			kernel = &kernels[i];
+			break;
+		}
+	}
+}
+
+
+const char *
+key2root_argon2_kernel(void)
+{
+	pthread_once(&kernel_once, select_kernel);
+	return kernel->name;
+}
+
+
+static void
+store32(unsigned char *bytes, uint_least32_t value)
+{
+	bytes[0] = (unsigned char)(value >> 0);
+	bytes[1] = (unsigned char)(value >> 8);
+	bytes[2] = (unsigned char)(value >> 16);
+	bytes[3] = (unsigned char)(value >> 24);
+}
+
+
+static void
+load_block(struct block *block, const unsigned char *bytes)
+{
+	size_t i, j;
+	for (i = 0; i < BLOCK_WORDS; i++, bytes += 8)
+		for (block->v[i] = 0, j = 0; j < 8; j++)
+			block->v[i] |= (uint64_t)bytes[j] << (8 * j);
+}
+
+
+static void
+store_block(unsigned char *bytes, const struct block *block)
+{
+	size_t i, j;
+	for (i = 0; i < BLOCK_WORDS; i++, bytes += 8)
+		for (j = 0; j < 8; j++)
+			bytes[j] = (unsigned char)(block->v[i] >> (8 * j));
+}
+
+
+static void
+hasher_init(struct hasher *hasher, size_t digest_len)
+{
+	struct libblake_blake2b_params params;
+
+	libblake_init();
+	memset(&params, 0, sizeof(params));
+	params.digest_len = (uint_least8_t)digest_len;
+	params.fanout = 1;
+	params.depth = 1;
+	libblake_blake2b_init(&hasher->state, &params);
+	hasher->len = 0;
+	hasher->digest_len = digest_len;
+}
+
+
+static void
+hasher_update(struct hasher *hasher, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+	size_t n;
+
+	/* a full block is only processed once more data follows, as the last block is padded */
+	while (len) {
+		if (hasher->len == HASH_BLOCK) {
+			libblake_blake2b_force_update(&hasher->state, hasher->block, HASH_BLOCK);
+			hasher->len = 0;
+		}
+		n = HASH_BLOCK - hasher->len;
+		n = n < len ? n : len;
+		memcpy(&hasher->block[hasher->len], bytes, n);
+		hasher->len += n;
+		bytes += n;
+		len -= n;
+	}
+}
+
+
+static void
+hasher_update_length(struct hasher *hasher, size_t len)
+{
+	unsigned char bytes[4];
+	store32(bytes, (uint_least32_t)len);
+	hasher_update(hasher, bytes, sizeof(bytes));
+}
+
+
+static void
+hasher_digest(struct hasher *hasher, unsigned char *digest)
+{
+	libblake_blake2b_digest(&hasher->state, hasher->block, hasher->len, 0, hasher->digest_len, digest);
+	libar2_erase(hasher, sizeof(*hasher));
+}
+
+
+/* H' in RFC 9106, BLAKE2b extended to any digest length */
+static void
+long_hash(unsigned char *out, size_t outlen, const void *in, size_t inlen)
+{
+	unsigned char v[HASH_SIZE];
+	struct hasher hasher;
+	size_t r, i;
+
+	hasher_init(&hasher, outlen < HASH_SIZE ? outlen : HASH_SIZE);
+	hasher_update_length(&hasher, outlen);
+	hasher_update(&hasher, in, inlen);
+	if (outlen <= HASH_SIZE) {
+		hasher_digest(&hasher, out);
+		return;
+	}
+	hasher_digest(&hasher, v);
+	memcpy(out, v, HASH_SIZE / 2);
+
+	r = (outlen + HASH_SIZE / 2 - 1) / (HASH_SIZE / 2) - 2;
+	for (i = 1; i < r; i++) {
+		hasher_init(&hasher, HASH_SIZE);
+		hasher_update(&hasher, v, HASH_SIZE);
+		hasher_digest(&hasher, v);
+		memcpy(&out[i * HASH_SIZE / 2], v, HASH_SIZE / 2);
+	}
+	hasher_init(&hasher, outlen - r * HASH_SIZE / 2);
+	hasher_update(&hasher, v, HASH_SIZE);
+	hasher_digest(&hasher, &out[r * HASH_SIZE / 2]);
+	libar2_erase(v, sizeof(v));
+}
+
+
+static void
+fill_block(void (*permute)(uint64_t r[BLOCK_WORDS]), const struct block *prev, const struct block *ref,
+           struct block *next, int with_xor)
+{
+	uint64_t r[BLOCK_WORDS], t[BLOCK_WORDS];
+	size_t i;
+
+	for (i = 0; i < BLOCK_WORDS; i++)
+		r[i] = t[i] = prev->v[i] ^ ref->v[i];
+	if (with_xor)
+		for (i = 0; i < BLOCK_WORDS; i++)
+			t[i] ^= next->v[i];
+	permute(r);
+	for (i = 0; i < BLOCK_WORDS; i++)
+		next->v[i] = t[i] ^ r[i];
+}
+
+
+static void
+next_addresses(void (*permute)(uint64_t r[BLOCK_WORDS]), struct block *address, struct block *input,
+               const struct block *zero)
+{
+	input->v[6] += 1;
+	fill_block(permute, zero, input, address, 0);
+	fill_block(permute, zero, address, address, 0);
+}
+
+
+static void
+fill_segment(const struct instance *inst, uint_least32_t pass, uint_least32_t lane, uint_least32_t slice)
+{
+	struct block address, input, zero;
+	uint_least32_t i, start = 0, offset, prev, ref_lane, area, first;
+	uint_least32_t segment_length = inst->segment_length, lane_length = inst->lane_length;
+	uint64_t rand, rel;
+	size_t ref;
+	int independent;
+
+	/* Argon2id uses Argon2i addressing for the first half of the first pass */
+	independent = inst->type == LIBAR2_ARGON2I ||
+	              (inst->type == LIBAR2_ARGON2ID && !pass && slice < SYNC_POINTS / 2);
+	if (independent) {
+		memset(&zero, 0, sizeof(zero));
+		memset(&input, 0, sizeof(input));
+		input.v[0] = pass;
+		input.v[1] = lane;
+		input.v[2] = slice;
+		input.v[3] = inst->nblocks;
+		input.v[4] = inst->passes;
+		input.v[5] = (uint64_t)inst->type;
+	}
+
+	/* the first two blocks of each lane are derived from H0 */
+	if (!pass && !slice) {
+		start = 2;
+		if (independent)
+			next_addresses(inst->permute, &address, &input, &zero);
+	}
+
+	offset = lane * lane_length + slice * segment_length + start;
+	prev = offset % lane_length ? offset - 1 : offset + lane_length - 1;
+
+	for (i = start; i < segment_length; i++, offset++, prev++) {
+		if (offset % lane_length == 1)
+			prev = offset - 1;
+
+		if (independent) {
+			if (i % BLOCK_WORDS == 0)
+				next_addresses(inst->permute, &address, &input, &zero);
+			rand = address.v[i % BLOCK_WORDS];
+		} else {
+			rand = inst->memory[prev].v[0];
+		}
+
+		ref_lane = !pass && !slice ? lane : (uint_least32_t)((rand >> 32) % inst->lanes);
+		if (!pass) {
+			if (!slice)
+				area = i - 1;
+			else if (ref_lane == lane)
+				area = slice * segment_length + i - 1;
+			else
+				area = slice * segment_length - !i;
+		} else {
+			if (ref_lane == lane)
+				area = lane_length - segment_length + i - 1;
+			else
+				area = lane_length - segment_length - !i;
+		}
+		rel = rand & 0xFFFFFFFFU;
+		rel = rel * rel >> 32;
+		rel = area - 1 - ((uint64_t)area * rel >> 32);
+		first = pass && slice != SYNC_POINTS - 1 ? (slice + 1) * segment_length : 0;
+		ref = (size_t)ref_lane * lane_length + (size_t)((first + rel) % lane_length);
+
+		fill_block(inst->permute, &inst->memory[prev], &inst->memory[ref], &inst->memory[offset],
+		           pass && inst->version != LIBAR2_ARGON2_VERSION_10);
+	}
+}
+
+
+/* idle threads are kept for the next hash, which may be computed by another thread */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct worker *idle_workers = NULL;
+
+
+static void
+await(pthread_mutex_t *mutex, pthread_cond_t *cond, unsigned int *value, unsigned int old)
+{
+	size_t i;
+
+	/* spinning first avoids a sleep and wakeup for each slice,
+	 * which would otherwise dominate when segments are short */
+	for (i = 0; i < SPINS; i++) {
+		if (LOAD(value) != old)
+			return;
+		RELAX();
+	}
+	pthread_mutex_lock(mutex);
+	while (*value == old)
+		pthread_cond_wait(cond, mutex);
+	pthread_mutex_unlock(mutex);
+}
+
+
+static int
+barrier(struct instance *inst)
+{
+	unsigned int phase;
+
+	pthread_mutex_lock(&inst->mutex);
+	phase = inst->phase;
+	if (++inst->waiting == inst->nthreads) {
+		inst->waiting = 0;
+		STORE(&inst->phase, phase + 1);
+		pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+		return 1;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+	await(&inst->mutex, &inst->cond, &inst->phase, phase);
+	return 0;
+}
+
+
+static int
+synchronise(struct instance *inst)
+{
+	/* all threads must see the same value, so it is read once per slice */
+	if (inst->nthreads == 1) {
+		inst->stop = inst->cancelled && *inst->cancelled;
+	} else {
+		if (barrier(inst))
+			inst->stop = inst->cancelled && *inst->cancelled;
+		barrier(inst);
+	}
+	return inst->stop;
+}
+
+
+static void
+fill_memory(struct instance *inst, size_t index)
+{
+	uint_least32_t pass, slice, lane;
+
+	for (pass = 0; pass < inst->passes; pass++) {
+		for (slice = 0; slice < SYNC_POINTS; slice++) {
+			for (lane = (uint_least32_t)index; lane < inst->lanes; lane += (uint_least32_t)inst->nthreads)
+				fill_segment(inst, pass, lane, slice);
+			if (synchronise(inst))
+				return;
+		}
+	}
+}
+
+
+static void *
+worker_main(void *data)
+{
+	struct worker *worker = data;
+	struct instance *inst;
+	unsigned int seen = 0;
+	size_t index;
+
+	for (;;) {
+		await(&worker->mutex, &worker->cond, &worker->posted, seen);
+		pthread_mutex_lock(&worker->mutex);
+		seen = worker->posted;
+		inst = worker->instance;
+		index = worker->index;
+		pthread_mutex_unlock(&worker->mutex);
+
+		fill_memory(inst, index);
+
+		/* the worker is made available before the hash is finished,
+		 * so that a following hash does not start new threads */
+		pthread_mutex_lock(&pool_mutex);
+		worker->next = idle_workers;
+		idle_workers = worker;
+		pthread_mutex_unlock(&pool_mutex);
+
+		/* the instance must not be touched after this */
+		pthread_mutex_lock(&inst->mutex);
+		STORE(&inst->pending, inst->pending - 1);
+		if (!inst->pending)
+			pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+	}
+	return NULL;
+}
+
+
+static struct worker *
+claim_worker(void)
+{
+	struct worker *worker;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&pool_mutex);
+	worker = idle_workers;
+	if (worker)
+		idle_workers = worker->next;
+	pthread_mutex_unlock(&pool_mutex);
+	if (worker)
+		return worker;
+
+	/* workers live until the process exits */
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		return NULL;
+	if (pthread_mutex_init(&worker->mutex, NULL))
+		goto fail_mutex;
+	if (pthread_cond_init(&worker->cond, NULL))
+		goto fail_cond;
+	if (pthread_attr_init(&attr))
+		goto fail_attr;
+	if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) || pthread_create(&thread, &attr, worker_main, worker))
+		goto fail_thread;
+	pthread_attr_destroy(&attr);
+	return worker;
+
+fail_thread:
+	pthread_attr_destroy(&attr);
+fail_attr:
+	pthread_cond_destroy(&worker->cond);
+fail_cond:
+	pthread_mutex_destroy(&worker->mutex);
+fail_mutex:
+	free(worker);
+	return NULL;
+}
+
+
+static void
+post(struct worker *worker, struct instance *inst, size_t index)
+{
+	pthread_mutex_lock(&worker->mutex);
+	worker->instance = inst;
+	worker->index = index;
+	STORE(&worker->posted, worker->posted + 1);
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mutex);
+}
+
+
+static int
+run(struct instance *inst)
+{
+	struct worker *workers = NULL, *worker;
+	size_t i, n;
+	long int nprocs;
+
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	n = nprocs > 1 ? (size_t)nprocs : 1;
+	if (n > inst->lanes)
+		n = inst->lanes;
+	if (inst->max_threads && n > inst->max_threads)
+		n = inst->max_threads;
+
+	if (pthread_mutex_init(&inst->mutex, NULL))
+		return -1;
+	if (pthread_cond_init(&inst->cond, NULL)) {
+		pthread_mutex_destroy(&inst->mutex);
+		return -1;
+	}
+	inst->stop = 0;
+	inst->waiting = 0;
+	inst->phase = 0;
+
+	/* lanes are distributed over the threads that could be claimed,
+	 * which must be known before any of them is started */
+	for (i = 1; i < n && (worker = claim_worker()); i++) {
+		worker->next = workers;
+		workers = worker;
+	}
+	inst->nthreads = i;
+	inst->pending = i - 1;
+	for (i = 1; workers; i++) {
+		worker = workers;
+		workers = worker->next;
+		post(worker, inst, i);
+	}
+
+	fill_memory(inst, 0);
+	for (i = 0; i < SPINS && LOAD(&inst->pending); i++)
+		RELAX();
+	pthread_mutex_lock(&inst->mutex);
+	while (inst->pending)
+		pthread_cond_wait(&inst->cond, &inst->mutex);
+	pthread_mutex_unlock(&inst->mutex);
+	pthread_cond_destroy(&inst->cond);
+	pthread_mutex_destroy(&inst->mutex);
+
+	if (inst->stop) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+
+int
+key2root_argon2_supported(const struct libar2_argon2_parameters *params, size_t msglen)
+{
+	/* anything else, including invalid parameters, is left to libar2 */
+	if (params->type != LIBAR2_ARGON2D && params->type != LIBAR2_ARGON2I && params->type != LIBAR2_ARGON2ID)
+		return 0;
+	if (params->version != LIBAR2_ARGON2_VERSION_10 && params->version != LIBAR2_ARGON2_VERSION_13)
+		return 0;
+	if (!params->lanes || params->lanes > MAX_LANES || !params->t_cost)
+		return 0;
+	if (params->m_cost < 2 * SYNC_POINTS * params->lanes)
+		return 0;
+	if (params->hashlen < 4 || params->hashlen > MAX_LENGTH || params->saltlen < 8 || params->saltlen > MAX_LENGTH)
+		return 0;
+	if (msglen > MAX_LENGTH || params->keylen > MAX_LENGTH || params->adlen > MAX_LENGTH)
+		return 0;
+	return 1;
+}
+
+
+int
+key2root_argon2_hash(void *hash, void *msg, size_t msglen, const struct libar2_argon2_parameters *params,
+                     struct libar2_context *ctx, size_t max_threads, volatile sig_atomic_t *cancelled)
+{
+	unsigned char h0[HASH_SIZE + 8], bytes[BLOCK_SIZE];
+	struct instance inst;
+	struct hasher hasher;
+	struct block final;
+	uint_least32_t lane, i;
+	int ret = -1, saved_errno;
+
+	pthread_once(&kernel_once, select_kernel);
+
+	memset(&inst, 0, sizeof(inst));
+	inst.permute = kernel->permute;
+	inst.passes = params->t_cost;
+	inst.lanes = params->lanes;
+	inst.segment_length = params->m_cost / (params->lanes * SYNC_POINTS);
+	inst.lane_length = inst.segment_length * SYNC_POINTS;
+	inst.nblocks = inst.lane_length * inst.lanes;
+	inst.type = (int)params->type;
+	inst.version = (int)params->version;
+	inst.max_threads = max_threads;
+	inst.cancelled = cancelled;
+
+	hasher_init(&hasher, HASH_SIZE);
+	hasher_update_length(&hasher, params->lanes);
+	hasher_update_length(&hasher, params->hashlen);
+	hasher_update_length(&hasher, params->m_cost);
+	hasher_update_length(&hasher, params->t_cost);
+	hasher_update_length(&hasher, (size_t)params->version);
+	hasher_update_length(&hasher, (size_t)params->type);
+	hasher_update_length(&hasher, msglen);
+	hasher_update(&hasher, msg, msglen);
+	hasher_update_length(&hasher, params->saltlen);
+	hasher_update(&hasher, params->salt, params->saltlen);
+	hasher_update_length(&hasher, params->keylen);
+	hasher_update(&hasher, params->key, params->keylen);
+	hasher_update_length(&hasher, params->adlen);
+	hasher_update(&hasher, params->ad, params->adlen);
+	hasher_digest(&hasher, h0);
+
+	if (ctx->autoerase_message)
+		libar2_erase(msg, msglen);
+	if (ctx->autoerase_secret)
+		libar2_erase(params->key, params->keylen);
+	if (ctx->autoerase_salt)
+		libar2_erase(params->salt, params->saltlen);
+	if (ctx->autoerase_associated_data)
+		libar2_erase(params->ad, params->adlen);
+
+	if ((size_t)inst.nblocks > SIZE_MAX / BLOCK_SIZE) {
+		errno = ENOMEM;
+		goto out;
+	}
+	inst.memory = ctx->allocate(inst.nblocks, BLOCK_SIZE, sizeof(struct block), ctx);
+	if (!inst.memory)
+		goto out;
+
+	for (lane = 0; lane < inst.lanes; lane++) {
+		store32(&h0[HASH_SIZE + 4], lane);
+		for (i = 0; i < 2; i++) {
+			store32(&h0[HASH_SIZE], i);
+			long_hash(bytes, BLOCK_SIZE, h0, sizeof(h0));
+			load_block(&inst.memory[(size_t)lane * inst.lane_length + i], bytes);
+		}
+	}
+
+	if (!run(&inst)) {
+		final = inst.memory[inst.lane_length - 1];
+		for (lane = 1; lane < inst.lanes; lane++)
+			for (i = 0; i < BLOCK_WORDS; i++)
+				final.v[i] ^= inst.memory[(size_t)lane * inst.lane_length + inst.lane_length - 1].v[i];
+		store_block(bytes, &final);
+		long_hash(hash, params->hashlen, bytes, BLOCK_SIZE);
+		ret = 0;
+	}
+
+	/* the deallocator erases the memory, or erases it once it is no longer
+	 * reused, but the memory of a hash that did not finish is erased now */
+	saved_errno = errno;
+	if (ret)
+		libar2_erase(inst.memory, (size_t)inst.nblocks * BLOCK_SIZE);
+	ctx->deallocate(inst.memory, ctx);
+	errno = saved_errno;
+
+out:
+	libar2_erase(h0, sizeof(h0));
+	libar2_erase(bytes, sizeof(bytes));
+	libar2_erase(&final, sizeof(final));
+	return ret;
+}
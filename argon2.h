@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+#include <signal.h>
+#include <stddef.h>
+#include <libar2.h>
+
+int key2root_argon2_supported(const struct libar2_argon2_parameters *params, size_t msglen);
+int key2root_argon2_hash(void *hash, void *msg, size_t msglen, const struct libar2_argon2_parameters *params,
+                         struct libar2_context *ctx, size_t max_threads, volatile sig_atomic_t *cancelled);
+const char *key2root_argon2_kernel(void);
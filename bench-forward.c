@@ -0,0 +1,124 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "forward.h"
+#include "readkey.h"
+
+
+char *argv0;
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-m ballast-mebibytes] [key-size] ...\n", argv0);
+	exit(1);
+}
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+
+static double
+run(struct key2root_key *key, int direct, size_t iterations)
+{
+	static char buf[64 << 10];
+	double start = now();
+	size_t i, total;
+	ssize_t r;
+	int fd;
+
+	for (i = 0; i < iterations; i++) {
+		fd = key2root_forward(key, direct);
+		if (fd < 0)
+			exit(1);
+		for (total = 0;; total += (size_t)r) {
+			r = read(fd, buf, sizeof(buf));
+			if (r <= 0) {
+				if (!r)
+					break;
+				fprintf(stderr, "%s: read <socket>: %s\n", argv0, strerror(errno));
+				exit(1);
+			}
+		}
+		close(fd);
+		while (wait(NULL) > 0);
+		if (total != key->len) {
+			fprintf(stderr, "%s: %zu of %zu bytes were forwarded\n", argv0, total, key->len);
+			exit(1);
+		}
+	}
+
+	return (now() - start) / (double)iterations;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	static const char *default_sizes[] = {"1024", "65536", "1048576", "16777216", NULL};
+	size_t iterations = 100, ballast = 256;
+	struct key2root_key key;
+	char *ballast_mem, *end;
+	const char **sizes;
+
+	ARGBEGIN {
+	case 'n':
+		iterations = (size_t)strtoul(EARGF(usage()), &end, 10);
+		if (*end || !iterations)
+			usage();
+		break;
+	case 'm':
+		ballast = (size_t)strtoul(EARGF(usage()), &end, 10);
+		if (*end)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	sizes = argc ? (const char **)argv : default_sizes;
+
+	/* Simulate the address space of a process that has been hashing keys */
+	ballast <<= 20;
+	ballast_mem = malloc(ballast + 1);
+	if (!ballast_mem) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	memset(ballast_mem, 1, ballast);
+
+	printf("%12s %14s %14s\n", "key-size", "fork (µs)", "direct (µs)");
+	for (; *sizes; sizes++) {
+		key.len = (size_t)strtoul(*sizes, &end, 10);
+		if (*end)
+			usage();
+		key.data = malloc(key.len + 1);
+		if (!key.data) {
+			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		memset(key.data, 'k', key.len);
+		key.from_file = 1; /* do not erase it between iterations */
+		printf("%12zu %14.1f", key.len, run(&key, 0, iterations) * 1000000.);
+		printf(" %14.1f\n", run(&key, 1, iterations) * 1000000.);
+		fflush(stdout);
+		free(key.data);
+	}
+
+	free(ballast_mem);
+	return 0;
+}
@@ -0,0 +1,133 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arg.h"
+
+
+char *argv0;
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n runs] [-i input-file] [-p prepare-command] label command [argument] ...\n", argv0);
+	exit(1);
+}
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+
+static double
+seconds(const struct timeval *tv)
+{
+	return (double)tv->tv_sec + (double)tv->tv_usec / 1000000.;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	const char *input = "/dev/null";
+	const char *prepare = NULL;
+	const char *label;
+	unsigned long int runs = 1, i;
+	double start, wall = 0, wall_min = 0, cpu = 0;
+	long int maxrss = 0;
+	struct rusage ru;
+	int status, exit_status = 0, fd;
+	pid_t pid;
+	char *end;
+
+	ARGBEGIN {
+	case 'n':
+		runs = strtoul(EARGF(usage()), &end, 10);
+		if (*end || !runs)
+			usage();
+		break;
+	case 'i':
+		input = EARGF(usage());
+		break;
+	case 'p':
+		prepare = EARGF(usage());
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc < 2)
+		usage();
+	label = *argv++;
+
+	for (i = 0; i < runs; i++) {
+		/* the preparation, e.g. restoring a fixture, is not measured */
+		if (prepare && system(prepare)) {
+			fprintf(stderr, "%s: %s: failed\n", argv0, prepare);
+			exit(1);
+		}
+		fd = open(input, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, input, strerror(errno));
+			exit(1);
+		}
+		start = now();
+		pid = fork();
+		switch (pid) {
+		case -1:
+			fprintf(stderr, "%s: fork: %s\n", argv0, strerror(errno));
+			exit(1);
+		case 0:
+			if (dup2(fd, STDIN_FILENO) < 0) {
+				fprintf(stderr, "%s: dup2 %s <stdin>: %s\n", argv0, input, strerror(errno));
+				_exit(1);
+			}
+			close(fd);
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0 && fd != STDOUT_FILENO) {
+				dup2(fd, STDOUT_FILENO);
+				close(fd);
+			}
+			execvp(argv[0], argv);
+			fprintf(stderr, "%s: execvp %s: %s\n", argv0, argv[0], strerror(errno));
+			_exit(1);
+		default:
+			break;
+		}
+		close(fd);
+		if (wait4(pid, &status, 0, &ru) != pid) {
+			fprintf(stderr, "%s: wait4: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		start = now() - start;
+		wall += start;
+		if (!i || start < wall_min)
+			wall_min = start;
+		cpu += seconds(&ru.ru_utime) + seconds(&ru.ru_stime);
+		if (ru.ru_maxrss > maxrss)
+			maxrss = ru.ru_maxrss;
+		if (!exit_status)
+			exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	}
+
+	printf("%-48s %11.3f %11.3f %11.3f %10li %4i\n", label,
+	       wall / (double)runs * 1000., wall_min * 1000., cpu / (double)runs * 1000., maxrss, exit_status);
+	if (fflush(stdout) || ferror(stdout)) {
+		fprintf(stderr, "%s: printf: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,119 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arg.h"
+#include "scan.h"
+
+
+char *argv0;
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [file-mebibytes] ...\n", argv0);
+	exit(1);
+}
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+
+/* Fills the buffer with lines like those in a key file, and returns the number of lines */
+static size_t
+synthesise(char *data, size_t len)
+{
+	static const char hash[] = "$argon2id$v=19$m=65536,t=3,p=4$ABCDabcd1234ABCDabcd12$"
+	                           "NVf6KJj9PDPW8BYdduqPWANVf6KJj9PDPW8BYdduqPWA";
+	size_t off = 0, n = 0;
+	int r;
+
+	while (off < len) {
+		r = snprintf(&data[off], len - off + 1, "key%zu %s\n", n, hash);
+		if (r < 0 || (size_t)r > len - off)
+			break;
+		off += (size_t)r;
+		n += 1;
+	}
+	/* the rest is left as a truncated line */
+	memset(&data[off], 'x', len - off);
+	return n;
+}
+
+
+static double
+run(const char *data, size_t len, size_t nlines, size_t iterations)
+{
+	struct key2root_scanner scanner;
+	struct key2root_line line;
+	double start = now();
+	size_t i, n, names;
+
+	for (i = 0; i < iterations; i++) {
+		n = names = 0;
+		key2root_scan_init(&scanner, data, len);
+		while (key2root_scan_line(&scanner, &line)) {
+			n += 1;
+			names += line.sp && !line.has_nul;
+		}
+		if (n != nlines || names != nlines) {
+			fprintf(stderr, "%s: %zu of %zu lines were scanned\n", argv0, names, nlines);
+			exit(1);
+		}
+	}
+
+	return (now() - start) / (double)iterations;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	static const char *default_sizes[] = {"1", "4", "16", "64", NULL};
+	size_t iterations = 20, len, nlines;
+	const char **sizes;
+	char *data, *end;
+	double t;
+
+	ARGBEGIN {
+	case 'n':
+		iterations = (size_t)strtoul(EARGF(usage()), &end, 10);
+		if (*end || !iterations)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	sizes = argc ? (const char **)argv : default_sizes;
+
+	printf("%12s %14s %14s  (%s)\n", "file-MiB", "lines", "scan (MiB/s)", key2root_scan_kernel());
+	for (; *sizes; sizes++) {
+		len = (size_t)strtoul(*sizes, &end, 10);
+		if (*end || !len)
+			usage();
+		len <<= 20;
+		data = malloc(len + 1);
+		if (!data) {
+			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		nlines = synthesise(data, len);
+		t = run(data, len, nlines, iterations);
+		printf("%12zu %14zu %14.1f\n", len >> 20, nlines, (double)len / (double)(1 << 20) / t);
+		fflush(stdout);
+		free(data);
+	}
+
+	return 0;
+}
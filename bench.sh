@@ -0,0 +1,118 @@
+#!/bin/sh
+# Benchmark suite, run with `make bench`. The programs are built from a copy
+# of the source tree, with KEYPATH, CONFPATH, and CACHEPATH in a temporary
+# directory so that fixtures can be created without touching the system.
+#
+# The number of runs per test can be set with BENCH_RUNS (default 5), and the
+# largest key size forwarded with BENCH_FORWARD_MAX (default 1073741824).
+#
+# Unless run as root, key2root exits with 125 after authenticating, as it
+# cannot change its user; this does not affect the measurements.
+
+set -e
+
+CONFIGFILE="${1:-config.mk}"
+MAKE="${MAKE:-make}"
+RUNS="${BENCH_RUNS:-5}"
+FORWARD_MAX="${BENCH_FORWARD_MAX:-1073741824}"
+CHEAP='$argon2id$v=19$m=8,t=1,p=1$*16$*32'
+
+dir="$(mktemp -d "${TMPDIR:-/tmp}/key2root-bench.XXXXXX")"
+trap 'rm -rf -- "$dir"' EXIT
+trap 'exit 1' HUP INT TERM
+
+src="$dir/src"
+keys="$dir/keys"
+mkdir -- "$src" "$keys"
+cp -- *.c *.h Makefile .pepper-validation.mk "$src/"
+cp -- "$CONFIGFILE" "$src/config.mk"
+$MAKE -C "$src" CONFIGFILE=config.mk \
+	KEYPATH="$keys" CONFPATH="$dir/key2root.conf" CACHEPATH="$dir/run" \
+	key2root key2root-addkey key2root-rmkey key2root-lskeys key2root-crypt key2root-compile \
+	bench-forward bench-run bench-scan >&2
+
+run="$src/bench-run"
+user="$(id -u)"
+
+header () {
+	printf '\n%-48s %11s %11s %11s %10s %4s\n' "$1" wall-ms min-ms cpu-ms maxrss-KiB exit
+}
+
+# fixtures: $1 lines for user $2, named k1, k2, ..., with the hash $3
+# on every line except the last one, which has the name $4 and hash $5
+entries () {
+	awk -v n="$1" -v h="$3" -v last="$4" -v lh="$5" \
+		'BEGIN { for (i = 1; i < n; i++) print "k" i " " h; print last " " lh }' > "$keys/$2"
+}
+
+head -c 1024 /dev/urandom > "$dir/key"
+head -c 1024 /dev/urandom > "$dir/wrongkey"
+
+
+header "key2root_crypt() via key2root-crypt"
+for m in 1024 16384 65536 262144; do
+	for t in 1 3; do
+		for p in 1 4; do
+			"$run" -n "$RUNS" -i "$dir/key" "crypt m=$m t=$t p=$p" \
+				"$src/key2root-crypt" "\$argon2id\$v=19\$m=$m,t=$t,p=$p\$*16\$*32"
+		done
+	done
+done
+
+
+header "authenticate() via key2root, matching key last"
+params='$argon2id$v=19$m=64,t=1,p=1$*16$*32'
+right="$("$src/key2root-crypt" "$params" < "$dir/key")"
+wrong="$("$src/key2root-crypt" "$params" < "$dir/wrongkey")"
+for n in 1 10 100 1000; do
+	entries $n "$user" "$wrong" match "$right"
+	"$run" -n "$RUNS" -i "$dir/key" "auth $n entries" "$src/key2root" true
+	"$run" -n "$RUNS" -i "$dir/key" "auth $n entries, -j 0" "$src/key2root" -j 0 true
+	"$run" -n "$RUNS" -i "$dir/key" "auth $n entries, -k" "$src/key2root" -k match true
+	"$src/key2root-compile" "$user"
+	"$run" -n "$RUNS" -i "$dir/key" "auth $n entries, -k, compiled" "$src/key2root" -k match true
+	rm -f -- "$keys/$user" "$keys/$user~db"
+done
+
+
+printf '\n%s\n' "forward() via bench-forward"
+sizes=""
+size=1024
+while test $size -le "$FORWARD_MAX"; do
+	sizes="$sizes $size"
+	size=$(( size * 32 ))
+done
+"$src/bench-forward" -n "$RUNS" -m 64 $sizes
+
+
+printf '\n%s\n' "key file scanning via bench-scan"
+for kernel in portable sse2 avx2; do
+	KEY2ROOT_SCAN_KERNEL=$kernel "$src/bench-scan" -n "$RUNS"
+done
+
+
+header "key2root-lskeys over 10000 users"
+awk -v dir="$keys" -v h="$wrong" 'BEGIN {
+	for (i = 0; i < 10000; i++) {
+		f = dir "/user" i
+		print "a " h > f
+		print "b " h > f
+		print "c " h > f
+		close(f)
+	}
+}'
+"$run" -n "$RUNS" "lskeys, all users" "$src/key2root-lskeys"
+"$run" -n "$RUNS" "lskeys, one user" "$src/key2root-lskeys" user5000
+rm -f -- "$keys"/user*
+
+
+header "key2root-addkey and key2root-rmkey on 100000 entries"
+entries 100000 big "$wrong" last "$wrong"
+cp -- "$keys/big" "$dir/big"
+names="$(awk 'BEGIN { for (i = 1; i <= 1000; i++) printf "k%i ", i * 97 }')"
+restore="cp -- '$dir/big' '$keys/big'"
+"$run" -n "$RUNS" -i "$dir/key" -p "$restore" "addkey, new key" "$src/key2root-addkey" big new "$CHEAP"
+"$run" -n "$RUNS" -i "$dir/key" -p "$restore" "addkey -r, replace key in the middle" \
+	"$src/key2root-addkey" -r big k50000 "$CHEAP"
+"$run" -n "$RUNS" -p "$restore" "rmkey, 1 key" "$src/key2root-rmkey" big k50000
+"$run" -n "$RUNS" -p "$restore" "rmkey, 1000 keys" "$src/key2root-rmkey" big $names
@@ -0,0 +1,382 @@
+/* See LICENSE file for copyright and license details. */
+#include "cache.h"
+#include "crypt.h"
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define PEPPER_SIZE 32
+#define RECORD_MAX 4096
+
+
+/* Each record is a single line:
+ *   <time> <dev> <ino> <mtime> <ctime> <digest> <key-name> <path>
+ * where <time> is the CLOCK_BOOTTIME time the key was verified at, <dev>,
+ * <ino>, <mtime>, and <ctime> identify the version of the key file, <path>,
+ * that contained the matching key, <key-name>, and <digest> is the keyed
+ * BLAKE2b digest of the key, with the per-boot pepper as the key */
+
+struct record {
+	uintmax_t time;
+	uintmax_t dev;
+	uintmax_t ino;
+	intmax_t mtime_sec;
+	long int mtime_nsec;
+	intmax_t ctime_sec;
+	long int ctime_nsec;
+	char digest[2 * KEY2ROOT_PREHASH_SIZE + 1];
+	char *keyname;
+	char *path;
+};
+
+
+static int
+readall(int fd, char *buf, size_t size, size_t *lenp)
+{
+	ssize_t r;
+
+	for (*lenp = 0; *lenp < size; *lenp += (size_t)r) {
+		r = read(fd, &buf[*lenp], size - *lenp);
+		if (r <= 0)
+			return r ? -1 : 0;
+	}
+	return 0;
+}
+
+
+static int
+writeall(int fd, const void *data, size_t len)
+{
+	const char *buf = data;
+	ssize_t r;
+
+	for (; len; len -= (size_t)r, buf = &buf[r]) {
+		r = write(fd, buf, len);
+		if (r < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+static int
+getpepper(unsigned char pepper[PEPPER_SIZE])
+{
+	char tmppath[sizeof(CACHEPATH"/pepper~") + 3 * sizeof(uintmax_t)];
+	size_t len;
+	int fd, ret = -1;
+
+	/* The cache lives in a tmpfs, so a new pepper is generated after every boot */
+	fd = open(CACHEPATH"/pepper", O_RDONLY | O_NOFOLLOW);
+	if (fd >= 0)
+		goto have_pepper;
+	if (errno != ENOENT)
+		return -1;
+
+	if (getrandom(pepper, PEPPER_SIZE, 0) != PEPPER_SIZE)
+		return -1;
+	sprintf(tmppath, "%s/pepper~%ju", CACHEPATH, (uintmax_t)getpid());
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		goto out;
+	if (writeall(fd, pepper, PEPPER_SIZE) || close(fd)) {
+		unlink(tmppath);
+		goto out;
+	}
+	/* link(2) rather than rename(2), so that concurrent processes agree on the pepper */
+	if (!link(tmppath, CACHEPATH"/pepper"))
+		ret = 0;
+	unlink(tmppath);
+	if (!ret || errno != EEXIST)
+		goto out;
+	fd = open(CACHEPATH"/pepper", O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		goto out;
+
+have_pepper:
+	if (!readall(fd, (char *)pepper, PEPPER_SIZE, &len) && len == PEPPER_SIZE)
+		ret = 0;
+	close(fd);
+out:
+	if (ret)
+		explicit_bzero(pepper, PEPPER_SIZE);
+	return ret;
+}
+
+
+static int
+stat_fields(const char *path, long long int *fields, size_t n)
+{
+	char buf[1024], *p, *end;
+	size_t len, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (readall(fd, buf, sizeof(buf) - 1, &len)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	/* The process name may contain any character, so the fields are
+	 * found after the last ')'; fields[0] is the 4th field (ppid) */
+	p = strrchr(buf, ')');
+	if (!p || p[1] != ' ' || !p[2] || p[3] != ' ')
+		return -1;
+	p = &p[3];
+	for (i = 0; i < n; i++, p = end) {
+		errno = 0;
+		fields[i] = strtoll(p, &end, 10);
+		if (errno || end == p)
+			return -1;
+	}
+	return 0;
+}
+
+
+static int
+getsession(char *buf)
+{
+	long long int fields[19];
+	long long int sid, tty;
+	char path[sizeof("/proc//stat") + 3 * sizeof(long long int)];
+
+	if (stat_fields("/proc/self/stat", fields, 4))
+		return -1;
+	sid = fields[2];
+	tty = fields[3];
+	if (sid <= 0)
+		return -1;
+
+	/* the session leader's start time prevents a reused session ID from inheriting the record */
+	sprintf(path, "/proc/%lli/stat", sid);
+	if (stat_fields(path, fields, 19))
+		return -1;
+
+	sprintf(buf, "%lli-%lli-%lli", sid, tty, fields[18]);
+	return 0;
+}
+
+
+static int
+digest_key(char hex[2 * KEY2ROOT_PREHASH_SIZE + 1], const char *key, size_t key_len)
+{
+	unsigned char pepper[PEPPER_SIZE];
+	unsigned char digest[KEY2ROOT_PREHASH_SIZE];
+	size_t i;
+
+	if (getpepper(pepper))
+		return -1;
+	key2root_keyed_prehash(digest, pepper, sizeof(pepper), key, key_len);
+	for (i = 0; i < sizeof(digest); i++)
+		sprintf(&hex[2 * i], "%02x", digest[i]);
+	explicit_bzero(pepper, sizeof(pepper));
+	explicit_bzero(digest, sizeof(digest));
+	return 0;
+}
+
+
+static int
+parse_record(char *buf, struct record *record)
+{
+	int n = 0;
+	char *p;
+
+	if (sscanf(buf, "%ju %ju %ju %jd.%ld %jd.%ld %128[0-9a-f] %n",
+	           &record->time, &record->dev, &record->ino,
+	           &record->mtime_sec, &record->mtime_nsec,
+	           &record->ctime_sec, &record->ctime_nsec,
+	           record->digest, &n) != 8 || !n)
+		return -1;
+	if (strlen(record->digest) != sizeof(record->digest) - 1)
+		return -1;
+	record->keyname = &buf[n];
+	p = strchr(record->keyname, ' ');
+	if (!p || p == record->keyname)
+		return -1;
+	*p++ = '\0';
+	record->path = p;
+	p = strchr(p, '\n');
+	if (!p || p[1] || p == record->path)
+		return -1;
+	*p = '\0';
+	return 0;
+}
+
+
+int
+key2root_cache_check(uid_t uid, const char *key, size_t key_len, const char *keyname, unsigned long int timeout)
+{
+	char path[sizeof(CACHEPATH"//") + 3 * sizeof(uintmax_t) + 3 * (3 * sizeof(long long int) + 1)];
+	char buf[RECORD_MAX + 1], hex[sizeof(((struct record *)0)->digest)];
+	struct record record;
+	struct timespec now;
+	struct stat st;
+	unsigned char diff = 0;
+	size_t len, i;
+	int fd, ret = 0;
+
+	if (!timeout)
+		return 0;
+
+	sprintf(path, "%s/%ju/", CACHEPATH, (uintmax_t)uid);
+	if (getsession(strchr(path, '\0')))
+		return 0;
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return 0;
+	if (readall(fd, buf, RECORD_MAX, &len)) {
+		close(fd);
+		goto out;
+	}
+	close(fd);
+	buf[len] = '\0';
+	if (parse_record(buf, &record))
+		goto out;
+
+	if (clock_gettime(CLOCK_BOOTTIME, &now) || (uintmax_t)now.tv_sec < record.time ||
+	    (uintmax_t)now.tv_sec - record.time >= (uintmax_t)timeout)
+		goto out;
+	if (keyname && strcmp(keyname, record.keyname))
+		goto out;
+
+	/* the key file must not have been changed since */
+	if (stat(record.path, &st) ||
+	    (uintmax_t)st.st_dev != record.dev || (uintmax_t)st.st_ino != record.ino ||
+	    (intmax_t)st.st_mtim.tv_sec != record.mtime_sec || st.st_mtim.tv_nsec != record.mtime_nsec ||
+	    (intmax_t)st.st_ctim.tv_sec != record.ctime_sec || st.st_ctim.tv_nsec != record.ctime_nsec)
+		goto out;
+
+	if (digest_key(hex, key, key_len))
+		goto out;
+	for (i = 0; i < sizeof(hex) - 1; i++)
+		diff |= (unsigned char)(hex[i] ^ record.digest[i]);
+	ret = !diff;
+
+out:
+	/* the record, once read, holds the peppered digest of the key */
+	explicit_bzero(hex, sizeof(hex));
+	explicit_bzero(buf, sizeof(buf));
+	explicit_bzero(&record, sizeof(record));
+	return ret;
+}
+
+
+int
+key2root_cache_store(uid_t uid, const char *key, size_t key_len, const char *path, const char *keyname)
+{
+	char dir[sizeof(CACHEPATH"/") + 3 * sizeof(uintmax_t)];
+	char file[sizeof(dir) + 1 + 3 * (3 * sizeof(long long int) + 1)];
+	char tmpfile[sizeof(file) + 1];
+	char hex[2 * KEY2ROOT_PREHASH_SIZE + 1];
+	struct timespec now;
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	if (stat(path, &st) || clock_gettime(CLOCK_BOOTTIME, &now))
+		return -1;
+
+	sprintf(dir, "%s/%ju", CACHEPATH, (uintmax_t)uid);
+	sprintf(file, "%s/", dir);
+	if (getsession(strchr(file, '\0')))
+		return -1;
+	sprintf(tmpfile, "%s~", file);
+
+	if (mkdir(CACHEPATH, 0700) && errno != EEXIST)
+		return -1;
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return -1;
+	if (digest_key(hex, key, key_len))
+		return -1;
+
+	fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (fd < 0)
+		goto fail;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto fail_unlink;
+	}
+	fprintf(f, "%ju %ju %ju %jd.%09ld %jd.%09ld %s %s %s\n",
+	        (uintmax_t)now.tv_sec, (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+	        (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+	        (intmax_t)st.st_ctim.tv_sec, st.st_ctim.tv_nsec,
+	        hex, keyname, path);
+	if (fflush(f) || ferror(f) || fclose(f))
+		goto fail_unlink;
+	if (rename(tmpfile, file))
+		goto fail_unlink;
+	explicit_bzero(hex, sizeof(hex));
+	return 0;
+
+fail_unlink:
+	unlink(tmpfile);
+fail:
+	explicit_bzero(hex, sizeof(hex));
+	return -1;
+}
+
+
+int
+key2root_cache_invalidate(uid_t uid)
+{
+	char path[sizeof(CACHEPATH"/") + 3 * sizeof(uintmax_t)];
+	struct dirent *f;
+	DIR *dir;
+	int fd, ret = 0;
+
+	sprintf(path, "%s/%ju", CACHEPATH, (uintmax_t)uid);
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+	fd = dirfd(dir);
+	while ((errno = 0, f = readdir(dir))) {
+		if (f->d_name[0] == '.' && (!f->d_name[1] || (f->d_name[1] == '.' && !f->d_name[2])))
+			continue;
+		if (unlinkat(fd, f->d_name, 0) && errno != ENOENT)
+			ret = -1;
+	}
+	if (errno)
+		ret = -1;
+	closedir(dir);
+	if (rmdir(path) && errno != ENOENT)
+		ret = -1;
+	return ret;
+}
+
+
+int
+key2root_cache_invalidate_user(const char *user)
+{
+	struct passwd *pwd;
+	uintmax_t uid;
+	char *end;
+
+	if (isdigit((unsigned char)*user)) {
+		errno = 0;
+		uid = strtoumax(user, &end, 10);
+		if (!errno && !*end && uid == (uintmax_t)(uid_t)uid)
+			return key2root_cache_invalidate((uid_t)uid);
+	}
+	errno = 0;
+	pwd = getpwnam(user);
+	if (!pwd)
+		return errno ? -1 : 0;
+	return key2root_cache_invalidate(pwd->pw_uid);
+}
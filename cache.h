@@ -0,0 +1,8 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/types.h>
+#include <stddef.h>
+
+int key2root_cache_check(uid_t uid, const char *key, size_t key_len, const char *keyname, unsigned long int timeout);
+int key2root_cache_store(uid_t uid, const char *key, size_t key_len, const char *path, const char *keyname);
+int key2root_cache_invalidate(uid_t uid);
+int key2root_cache_invalidate_user(const char *user);
@@ -0,0 +1,232 @@
+/* See LICENSE file for copyright and license details. */
+#include "conf.h"
+#include "crypt.h"
+#include "mapfile.h"
+#include "tune.h"
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+extern char *argv0;
+
+
+static int
+parse_ulong(const char *value, size_t len, unsigned long int *out)
+{
+	unsigned long int n = 0;
+	size_t i;
+
+	if (!len)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (!isdigit((unsigned char)value[i]))
+			return -1;
+		if (n > (ULONG_MAX - (unsigned long int)(value[i] - '0')) / 10)
+			return -1;
+		n = n * 10 + (unsigned long int)(value[i] - '0');
+	}
+	*out = n;
+	return 0;
+}
+
+
+static int
+parse_uint32(const char *value, size_t len, uint_least32_t *out)
+{
+	unsigned long int n;
+
+	if (parse_ulong(value, len, &n) || n > UINT_LEAST32_MAX)
+		return -1;
+	*out = (uint_least32_t)n;
+	return 0;
+}
+
+
+static int
+parse_memory(const char *value, size_t len, uint_least32_t *out)
+{
+	char *str;
+	int r;
+
+	str = strndup(value, len);
+	if (!str) {
+		fprintf(stderr, "%s: strndup: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	r = key2root_parse_memory(str, out);
+	free(str);
+	return r;
+}
+
+
+static int
+parse_parameters(const char *value, size_t len, char **out)
+{
+	char *str;
+	size_t i;
+
+	if (!len)
+		return -1;
+	for (i = 0; i < len; i++)
+		if (isspace((unsigned char)value[i]))
+			return -1;
+	str = strndup(value, len);
+	if (!str) {
+		fprintf(stderr, "%s: strndup: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	if (key2root_crypt_cost(str, NULL, NULL, NULL)) {
+		free(str);
+		return -1;
+	}
+	free(*out);
+	*out = str;
+	return 0;
+}
+
+
+static int
+setting(struct key2root_config *conf, const char *name, size_t name_len, const char *value, size_t value_len, size_t lineno)
+{
+#define IS(NAME) (name_len == sizeof(NAME) - 1 && !memcmp(name, NAME, name_len))
+
+	if (IS("cache-timeout")) {
+		if (parse_ulong(value, value_len, &conf->cache_timeout))
+			goto bad_value;
+	} else if (IS("rehash")) {
+		if (parse_parameters(value, value_len, &conf->rehash_parameters))
+			goto bad_value;
+	} else if (IS("max-memory")) {
+		if (parse_memory(value, value_len, &conf->max_memory))
+			goto bad_value;
+	} else if (IS("max-passes")) {
+		if (parse_uint32(value, value_len, &conf->max_passes))
+			goto bad_value;
+	} else if (IS("max-lanes")) {
+		if (parse_uint32(value, value_len, &conf->max_lanes))
+			goto bad_value;
+	} else if (IS("budget")) {
+		if (parse_memory(value, value_len, &conf->budget))
+			goto bad_value;
+	} else {
+		fprintf(stderr, "%s: unknown setting in %s on line %zu: %.*s\n", argv0, CONFPATH, lineno, (int)name_len, name);
+		return -1;
+	}
+	return 0;
+
+bad_value:
+	fprintf(stderr, "%s: bad value for %.*s in %s on line %zu\n", argv0, (int)name_len, name, CONFPATH, lineno);
+	return -1;
+
+#undef IS
+}
+
+
+int
+key2root_load_config(struct key2root_config *conf)
+{
+	struct key2root_file file;
+	struct stat st;
+	const char *line, *end, *nl, *eq, *name_end, *value, *value_end, *exceeded;
+	uint_least32_t m_cost, t_cost, lanes;
+	size_t lineno = 0;
+	int fd, failed = 0;
+
+	memset(conf, 0, sizeof(*conf));
+
+	fd = open(CONFPATH, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, CONFPATH, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "%s: fstat %s: %s\n", argv0, CONFPATH, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* key2root is setuid, so its configuration must only be modifiable by root */
+	if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "%s: %s must be owned by root and not writable by others\n", argv0, CONFPATH);
+		close(fd);
+		return -1;
+	}
+	if (key2root_load_file(fd, &file)) {
+		fprintf(stderr, "%s: read %s: %s\n", argv0, CONFPATH, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	for (line = file.data, end = &file.data[file.len]; line < end; line = &nl[1]) {
+		nl = memchr(line, '\n', (size_t)(end - line));
+		if (!nl)
+			nl = end;
+		lineno += 1;
+
+		while (line < nl && isspace((unsigned char)*line))
+			line++;
+		if (line == nl || *line == '#')
+			continue;
+		eq = memchr(line, '=', (size_t)(nl - line));
+		if (!eq) {
+			fprintf(stderr, "%s: no '=' found in %s on line %zu\n", argv0, CONFPATH, lineno);
+			failed = 1;
+			continue;
+		}
+		for (name_end = eq; name_end > line && isspace((unsigned char)name_end[-1]); name_end--);
+		for (value = &eq[1]; value < nl && isspace((unsigned char)*value); value++);
+		for (value_end = nl; value_end > value && isspace((unsigned char)value_end[-1]); value_end--);
+
+		if (setting(conf, line, (size_t)(name_end - line), value, (size_t)(value_end - value), lineno))
+			failed = 1;
+	}
+
+	key2root_unload_file(&file);
+
+	/* keys rehashed by key2root must be checkable by it */
+	if (conf->rehash_parameters && !key2root_crypt_cost(conf->rehash_parameters, &m_cost, &t_cost, &lanes)) {
+		exceeded = key2root_exceeds_limits(conf, m_cost, t_cost, lanes);
+		if (exceeded) {
+			fprintf(stderr, "%s: rehash exceeds %s in %s\n", argv0, exceeded, CONFPATH);
+			failed = 1;
+		}
+	}
+
+	return -failed;
+}
+
+
+void
+key2root_free_config(struct key2root_config *conf)
+{
+	free(conf->rehash_parameters);
+	conf->rehash_parameters = NULL;
+}
+
+
+/* Returns the name of the setting a key hash with the specified costs
+ * exceeds, or NULL if it may be checked; a key that costs more than the
+ * whole budget could never be checked */
+const char *
+key2root_exceeds_limits(const struct key2root_config *conf, uint_least32_t m_cost,
+                        uint_least32_t t_cost, uint_least32_t lanes)
+{
+	if (conf->max_memory && m_cost > conf->max_memory)
+		return "max-memory";
+	if (conf->max_passes && t_cost > conf->max_passes)
+		return "max-passes";
+	if (conf->max_lanes && lanes > conf->max_lanes)
+		return "max-lanes";
+	if (conf->budget && (uintmax_t)m_cost * t_cost > conf->budget)
+		return "budget";
+	return NULL;
+}
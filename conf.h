@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+
+struct key2root_config {
+	unsigned long int cache_timeout; /* in seconds, 0 if credentials shall not be cached */
+	char *rehash_parameters; /* NULL if keys shall not be rehashed */
+	uint_least32_t max_memory; /* in kibibytes, per key, 0 if unlimited */
+	uint_least32_t max_passes; /* per key, 0 if unlimited */
+	uint_least32_t max_lanes; /* per key, 0 if unlimited */
+	uint_least32_t budget; /* in kibibytes, counted once per pass, for all keys checked, 0 if unlimited */
+};
+
+int key2root_load_config(struct key2root_config *conf);
+void key2root_free_config(struct key2root_config *conf);
+const char *key2root_exceeds_limits(const struct key2root_config *conf, uint_least32_t m_cost,
+                                    uint_least32_t t_cost, uint_least32_t lanes);
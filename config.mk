@@ -1,7 +1,9 @@
 PREFIX    = /usr
 MANPREFIX = $(PREFIX)/share/man
 
-KEYPATH = /etc/key2root
+KEYPATH   = /etc/key2root
+CONFPATH  = /etc/key2root.conf
+CACHEPATH = /run/key2root
 
 CC = c99
 
@@ -11,7 +13,7 @@ GCC_SANITIZE    = -O1 $(COMMON_SANITIZE)
 #SANITIZE        = $(CLANG_SANITIZE)
 #SANITIZE        = $(GCC_SANITIZE)
 
-CPPFLAGS      = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE -D'KEYPATH="$(KEYPATH)"'
+CPPFLAGS      = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE -D'KEYPATH="$(KEYPATH)"' -D'CONFPATH="$(CONFPATH)"' -D'CACHEPATH="$(CACHEPATH)"'
 CFLAGS        = $(SANITIZE) -Wall -O2
 LDFLAGS       = $(SANITIZE)
 LDFLAGS_CRYPT = $(SANITIZE) $(LDFLAGS) -lar2simplified -lar2 -lblake -pthread
@@ -1,11 +1,35 @@
 /* See LICENSE file for copyright and license details. */
 #include "crypt.h"
+#include "argon2.h"
+#include "decode.h"
+#include "trace.h"
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <libar2simplified.h>
 #include <libar2.h>
+#include <libblake.h>
+
+
+#define ARENA_MIN_SIZE (8 << 10)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define PREFAULT_MAX_THREADS 64
+#define PREFAULT_MIN_SIZE ((size_t)32 << 20)
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+# define HUGETLB_FLAGS (MAP_HUGETLB | MAP_HUGE_2MB)
+#elif defined(MAP_HUGETLB)
+# define HUGETLB_FLAGS MAP_HUGETLB
+#endif
+#define PREHASH_BLOCK 128
+#define PREHASH_BUFFER_SIZE (64 << 10)
+
 
 extern char *argv0;
 
@@ -18,21 +42,473 @@ static unsigned char pepper[] = {
 	0xce, 0x5d, 0xdc, 0x58, 0x82, 0x90, 0xed, 0xff
 };
 
+static volatile sig_atomic_t cancelled = 0;
+static size_t max_threads = 0;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+static size_t (*simplified_get_ready_threads)(size_t *indices, size_t n, struct libar2_context *ctx);
+static void *(*simplified_allocate)(size_t num, size_t size, size_t alignment, struct libar2_context *ctx);
+static void (*simplified_deallocate)(void *ptr, struct libar2_context *ctx);
 
-char *
-key2root_crypt(char *msg, size_t msglen, const char *paramstr, int autoerase)
+/* Argon2 memory is reused across hashes, rather than being
+ * allocated, faulted in, and freed once per hash */
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *arena = NULL;
+static size_t arena_size = 0;
+static size_t arena_used = 0;
+static int arena_busy = 0;
+
+/* Argon2 memory that could not be placed in the arena, because it was busy or,
+ * if size is 0, because it is allocated by libar2simplified; it is erased when freed */
+struct mapping {
+	void *addr;
+	size_t size;
+	size_t used;
+	struct mapping *next;
+};
+static struct mapping *mappings = NULL;
+
+struct prefault {
+	volatile unsigned char *start;
+	size_t size;
+	size_t pagesize;
+	pthread_t thread;
+};
+
+
+static void *
+prefault_range(void *data)
+{
+	struct prefault *range = data;
+	size_t off;
+	for (off = 0; off < range->size; off += range->pagesize)
+		range->start[off] = 0;
+	return NULL;
+}
+
+
+static size_t
+prefault(void *mem, size_t size, size_t pagesize)
+{
+	struct prefault ranges[PREFAULT_MAX_THREADS];
+	size_t i, n, per, off = 0;
+	long int nprocs;
+
+	/* page faults are taken in parallel, rather than one at a time as with MAP_POPULATE */
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	n = nprocs > 1 ? (size_t)nprocs : 1;
+	if (n > PREFAULT_MAX_THREADS)
+		n = PREFAULT_MAX_THREADS;
+	if (n > size / PREFAULT_MIN_SIZE)
+		n = size / PREFAULT_MIN_SIZE ? size / PREFAULT_MIN_SIZE : 1;
+	per = (size / pagesize + n - 1) / n * pagesize;
+
+	for (i = 0; i < n; i++, off += per) {
+		ranges[i].start = (unsigned char *)mem + off;
+		ranges[i].size = off >= size ? 0 : size - off < per ? size - off : per;
+		ranges[i].pagesize = pagesize;
+		/* a range is faulted in by this thread if its thread cannot be created */
+		if (i && pthread_create(&ranges[i].thread, NULL, prefault_range, &ranges[i])) {
+			prefault_range(&ranges[i]);
+			ranges[i].size = 0;
+		}
+	}
+	prefault_range(&ranges[0]);
+	for (i = 1; i < n; i++)
+		if (ranges[i].size)
+			pthread_join(ranges[i].thread, NULL);
+	return n;
+}
+
+
+/* Memory is locked only within RLIMIT_MEMLOCK, even though the kernel would
+ * let root lock any amount, so that large cost parameters cannot pin most of
+ * the machine's memory; memory above the limit is used without being locked */
+static int
+lockable(size_t size)
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_MEMLOCK, &limit))
+		return 0;
+	return limit.rlim_cur == RLIM_INFINITY || (uintmax_t)size <= (uintmax_t)limit.rlim_cur;
+}
+
+
+static void *
+map_memory(size_t size, size_t *sizep)
+{
+	struct key2root_trace trace;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE), faultsize, threads;
+	const char *how = "regular pages";
+	char *mem, *aligned;
+	int locked;
+
+	key2root_trace_start(&trace);
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	faultsize = pagesize;
+
+	/* explicit huge pages are used if reserved, otherwise transparent huge pages are
+	 * requested, both of which need fewer page faults and TLB entries */
+	if (size >= HUGE_PAGE_SIZE) {
+#ifdef HUGETLB_FLAGS
+		mem = mmap(NULL, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1), PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | HUGETLB_FLAGS, -1, 0);
+		if (mem != MAP_FAILED) {
+			size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+			faultsize = HUGE_PAGE_SIZE;
+			how = "explicit huge pages";
+			goto mapped;
+		}
+#endif
+#ifdef MADV_HUGEPAGE
+		/* transparent huge pages are only used in aligned regions */
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		mem = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+		aligned = (char *)(((uintptr_t)mem + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if (aligned != mem)
+			munmap(mem, (size_t)(aligned - mem));
+		if (aligned != mem + HUGE_PAGE_SIZE)
+			munmap(aligned + size, (size_t)(mem + HUGE_PAGE_SIZE - aligned));
+		mem = aligned;
+		if (!madvise(mem, size, MADV_HUGEPAGE))
+			how = "transparent huge pages";
+		goto mapped;
+#endif
+	}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+mapped:
+	threads = prefault(mem, size, faultsize);
+	/* locking keeps key-derived state out of swap, if permitted */
+	locked = lockable(size) && !mlock(mem, size);
+	key2root_trace_stop(&trace, "map %zu KiB of Argon2 memory with %s, prefaulted by %zu threads, %s",
+	                    size >> 10, how, threads, locked ? "locked" : "not locked");
+	*sizep = size;
+	return mem;
+}
+
+
+static void
+release_arena(void)
+{
+	if (arena) {
+		libar2_erase(arena, arena_used);
+		munmap(arena, arena_size);
+	}
+	arena = NULL;
+	arena_size = 0;
+	arena_used = 0;
+}
+
+
+static int
+resize_arena(size_t size)
+{
+	void *new = map_memory(size, &size);
+	if (!new)
+		return -1;
+	release_arena();
+	arena = new;
+	arena_size = size;
+	return 0;
+}
+
+
+static void *
+allocate(size_t num, size_t size, size_t alignment, struct libar2_context *ctx)
+{
+	struct mapping *mapping;
+	void *ret = NULL;
+	size_t n;
+
+	/* only the Argon2 memory is large enough to be worth placing in the arena */
+	if (size && num > SIZE_MAX / size)
+		goto fallback;
+	n = num * size;
+	if (n < ARENA_MIN_SIZE || alignment > (size_t)sysconf(_SC_PAGESIZE))
+		goto fallback;
+
+	pthread_mutex_lock(&arena_mutex);
+	if (!arena_busy && (n <= arena_size || !resize_arena(n))) {
+		arena_busy = 1;
+		if (n > arena_used)
+			arena_used = n;
+		ret = arena;
+	}
+	pthread_mutex_unlock(&arena_mutex);
+	if (ret)
+		return ret;
+
+	/* when hashes run in parallel, the others get their own mappings */
+	mapping = malloc(sizeof(*mapping));
+	if (!mapping)
+		goto fallback;
+	mapping->addr = map_memory(n, &mapping->size);
+	if (!mapping->addr) {
+		free(mapping);
+		goto fallback;
+	}
+	mapping->used = n;
+	goto out;
+
+fallback:
+	ret = simplified_allocate(num, size, alignment, ctx);
+	if (!ret)
+		return NULL;
+	mapping = malloc(sizeof(*mapping));
+	if (!mapping) {
+		simplified_deallocate(ret, ctx);
+		return NULL;
+	}
+	mapping->addr = ret;
+	mapping->size = 0;
+	mapping->used = num * size;
+
+out:
+	pthread_mutex_lock(&arena_mutex);
+	mapping->next = mappings;
+	mappings = mapping;
+	pthread_mutex_unlock(&arena_mutex);
+	return mapping->addr;
+}
+
+
+static void
+deallocate(void *ptr, struct libar2_context *ctx)
+{
+	struct mapping *mapping = NULL, **mappingp;
+	int in_arena;
+
+	pthread_mutex_lock(&arena_mutex);
+	in_arena = ptr && ptr == arena;
+	if (in_arena)
+		arena_busy = 0;
+	for (mappingp = &mappings; !in_arena && ptr && *mappingp; mappingp = &(*mappingp)->next) {
+		if ((*mappingp)->addr == ptr) {
+			mapping = *mappingp;
+			*mappingp = mapping->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena_mutex);
+
+	if (mapping) {
+		libar2_erase(mapping->addr, mapping->used);
+		if (mapping->size)
+			munmap(mapping->addr, mapping->size);
+		else
+			simplified_deallocate(mapping->addr, ctx);
+		free(mapping);
+	} else if (!in_arena) {
+		simplified_deallocate(ptr, ctx);
+	}
+}
+
+
+static size_t
+get_ready_threads(size_t *indices, size_t n, struct libar2_context *ctx)
+{
+	/* libar2_hash fails if no thread is ready, which lets us abort between slices */
+	if (cancelled) {
+		errno = ECANCELED;
+		return 0;
+	}
+	return simplified_get_ready_threads(indices, n, ctx);
+}
+
+
+static void
+init_context_once(void)
+{
+	struct libar2_context ctx;
+	libar2simplified_init_context(&ctx);
+	simplified_get_ready_threads = ctx.get_ready_threads;
+	simplified_allocate = ctx.allocate;
+	simplified_deallocate = ctx.deallocate;
+}
+
+
+static void
+init_context(struct libar2_context *ctx)
+{
+	pthread_once(&context_once, init_context_once);
+	libar2simplified_init_context(ctx);
+	ctx->get_ready_threads = get_ready_threads;
+	ctx->allocate = allocate;
+	ctx->deallocate = deallocate;
+}
+
+
+void
+key2root_crypt_reserve(uint_least32_t m_cost)
 {
-	struct libar2_argon2_parameters *params = NULL;
-	char *end, *ret = NULL, *hash = NULL;
 	size_t size;
+
+	if ((uintmax_t)m_cost > SIZE_MAX / 1024)
+		return;
+	size = (size_t)m_cost * 1024;
+	if (size < ARENA_MIN_SIZE)
+		return;
+
+	pthread_mutex_lock(&arena_mutex);
+	if (!arena_busy && size > arena_size)
+		resize_arena(size);
+	pthread_mutex_unlock(&arena_mutex);
+}
+
+
+void
+key2root_crypt_release(void)
+{
+	pthread_mutex_lock(&arena_mutex);
+	if (!arena_busy)
+		release_arena();
+	pthread_mutex_unlock(&arena_mutex);
+}
+
+
+const char *
+key2root_crypt_kernel(void)
+{
+	return key2root_argon2_kernel();
+}
+
+
+/* Limits the number of threads each hash may use, 0 for one per processor; when
+ * hashes are computed in parallel, this is their share of the processors */
+void
+key2root_crypt_limit_threads(size_t n)
+{
+	max_threads = n;
+}
+
+
+void
+key2root_crypt_cancel(void)
+{
+	cancelled = 1;
+}
+
+
+void
+key2root_crypt_resume(void)
+{
+	cancelled = 0;
+}
+
+
+int
+key2root_crypt_cost(const char *paramstr, uint_least32_t *m_costp, uint_least32_t *t_costp, uint_least32_t *lanesp)
+{
+	struct libar2_argon2_parameters *params;
+
+	if (key2root_prehashed(paramstr))
+		paramstr = key2root_prehashed(paramstr);
+	params = libar2simplified_decode_r(paramstr, NULL, NULL, NULL, NULL);
+	if (!params)
+		return -1;
+	if (m_costp)
+		*m_costp = params->m_cost;
+	if (t_costp)
+		*t_costp = params->t_cost;
+	if (lanesp)
+		*lanesp = params->lanes;
+	libar2_erase(params->salt, params->saltlen);
+	free(params);
+	return 0;
+}
+
+
+/* Whether a key hash was made with another algorithm or other costs than
+ * a parameter string specifies; whether the key is prehashed is ignored */
+int
+key2root_crypt_differs(const char *hashstr, const char *paramstr)
+{
+	struct libar2_argon2_parameters *a, *b;
+	int ret;
+
+	if (key2root_prehashed(hashstr))
+		hashstr = key2root_prehashed(hashstr);
+	if (key2root_prehashed(paramstr))
+		paramstr = key2root_prehashed(paramstr);
+	a = libar2simplified_decode_r(hashstr, NULL, NULL, NULL, NULL);
+	if (!a)
+		return -1;
+	b = libar2simplified_decode_r(paramstr, NULL, NULL, NULL, NULL);
+	if (!b) {
+		libar2_erase(a->salt, a->saltlen);
+		free(a);
+		return -1;
+	}
+	ret = a->type != b->type || a->version != b->version || a->m_cost != b->m_cost ||
+	      a->t_cost != b->t_cost || a->lanes != b->lanes;
+	libar2_erase(a->salt, a->saltlen);
+	libar2_erase(b->salt, b->saltlen);
+	free(a);
+	free(b);
+	return ret;
+}
+
+
+int
+key2root_hash(void *hash, char *msg, size_t msglen, struct libar2_argon2_parameters *params, int autoerase)
+{
 	struct libar2_context ctx;
+	int ret;
 
-	libar2simplified_init_context(&ctx);
+	if (cancelled) {
+		if (autoerase)
+			libar2_erase(msg, msglen);
+		errno = ECANCELED;
+		return -1;
+	}
+
+	init_context(&ctx);
 	ctx.autoerase_message = (unsigned char)autoerase;
 	ctx.autoerase_secret = 0;
+	ctx.autoerase_salt = 0;
+
+	params->key = pepper;
+	params->keylen = sizeof(pepper);
+
+	/* libar2 is only used for what the in-tree implementation does not support */
+	if (key2root_argon2_supported(params, msglen))
+		ret = key2root_argon2_hash(hash, msg, msglen, params, &ctx, max_threads, &cancelled);
+	else
+		ret = libar2_hash(hash, msg, msglen, params, &ctx);
+	if (ret) {
+		if (autoerase)
+			libar2_erase(msg, msglen);
+		return -1;
+	}
+	return 0;
+}
+
+
+char *
+key2root_crypt(char *msg, size_t msglen, const char *paramstr, int autoerase)
+{
+	struct libar2_argon2_parameters *params = NULL;
+	char *end, *ret = NULL, *hash = NULL, *encoded;
+	const char *prefix = "";
+	size_t size;
+
+	if (cancelled) {
+		if (autoerase)
+			libar2_erase(msg, msglen);
+		errno = ECANCELED;
+		return NULL;
+	}
 
 	if (!paramstr)
 		paramstr = libar2simplified_recommendation(0);
+	if (key2root_prehashed(paramstr)) {
+		paramstr = key2root_prehashed(paramstr);
+		prefix = KEY2ROOT_PREHASH_PREFIX;
+	}
 
 	params = libar2simplified_decode_r(paramstr, NULL, &end, NULL, NULL);
 	if (!params) {
@@ -44,9 +520,6 @@ key2root_crypt(char *msg, size_t msglen, const char *paramstr, int autoerase)
 		goto out;
 	}
 
-	params->key = pepper;
-	params->keylen = sizeof(pepper);
-
 	size = libar2_hash_buf_size(params);
 	if (!size)
 		abort();
@@ -55,14 +528,24 @@ key2root_crypt(char *msg, size_t msglen, const char *paramstr, int autoerase)
 		goto out;
 	}
 
-	if (libar2_hash(hash, msg, msglen, params, &ctx)) {
-		if (autoerase)
-			libar2_erase(msg, msglen);
+	if (key2root_hash(hash, msg, msglen, params, autoerase)) {
+		if (cancelled)
+			goto out;
 		fprintf(stderr, "%s: libar2simplified_hash %s: %s\n", argv0, paramstr, strerror(errno));
 		goto out;
 	}
 
-	ret = libar2simplified_encode(params, hash);
+	encoded = libar2simplified_encode(params, hash);
+	if (encoded && *prefix) {
+		ret = malloc(strlen(prefix) + strlen(encoded) + 1);
+		if (ret)
+			stpcpy(stpcpy(ret, prefix), encoded);
+		else
+			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		free(encoded);
+	} else {
+		ret = encoded;
+	}
 
 out:
 	if (params) {
@@ -72,3 +555,215 @@ out:
 	free(hash);
 	return ret;
 }
+
+
+static int
+hashequal(const char *a, const char *b)
+{
+	size_t an = strlen(a) + 1;
+	size_t bn = strlen(b) + 1;
+	size_t n = an < bn ? an : bn;
+	size_t i;
+	int diff = 0;
+	for (i = 0; i < n; i++)
+		diff |= a[i] ^ b[i];
+	return !diff;
+}
+
+
+static int
+digestequal(const unsigned char *a, const unsigned char *b, size_t n)
+{
+	size_t i;
+	int diff = 0;
+	for (i = 0; i < n; i++)
+		diff |= a[i] ^ b[i];
+	return !diff;
+}
+
+
+/* Like key2root_crypt_cost, but for a key hash that need not be NUL-terminated;
+ * a key hash in the form libar2simplified_encode() produces is decoded without
+ * allocating memory */
+int
+key2root_crypt_hash_cost(const char *stored, size_t stored_len,
+                         uint_least32_t *m_costp, uint_least32_t *t_costp, uint_least32_t *lanesp)
+{
+	struct libar2_argon2_parameters params;
+	unsigned char salt[KEY2ROOT_VERIFY_MAX_SALT], tag[KEY2ROOT_VERIFY_MAX_DIGEST];
+	const char *s = stored;
+	size_t n = sizeof(KEY2ROOT_PREHASH_PREFIX) - 1;
+	char *copy;
+	int ret;
+
+	if (stored_len > n && !memcmp(stored, KEY2ROOT_PREHASH_PREFIX"$", n + 1))
+		s = &stored[n];
+
+	if (key2root_decode_hash(s, &stored[stored_len], &params, salt, tag)) {
+		copy = strndup(stored, stored_len);
+		if (!copy)
+			return -1;
+		ret = key2root_crypt_cost(copy, m_costp, t_costp, lanesp);
+		free(copy);
+		return ret;
+	}
+	if (m_costp)
+		*m_costp = params.m_cost;
+	if (t_costp)
+		*t_costp = params.t_cost;
+	if (lanesp)
+		*lanesp = params.lanes;
+	return 0;
+}
+
+
+int
+key2root_verify(char *msg, size_t msglen, const char *stored, size_t stored_len, int autoerase)
+{
+	struct libar2_argon2_parameters params;
+	unsigned char salt[KEY2ROOT_VERIFY_MAX_SALT], tag[KEY2ROOT_VERIFY_MAX_DIGEST], digest[KEY2ROOT_VERIFY_MAX_DIGEST];
+	const char *s = stored;
+	size_t n = sizeof(KEY2ROOT_PREHASH_PREFIX) - 1, size;
+	char *copy, *hash;
+	int ret;
+
+	if (stored_len > n && !memcmp(stored, KEY2ROOT_PREHASH_PREFIX"$", n + 1))
+		s = &stored[n];
+
+	if (!key2root_decode_hash(s, &stored[stored_len], &params, salt, tag)) {
+		size = libar2_hash_buf_size(&params);
+		if (size && size <= sizeof(digest)) {
+			if (key2root_hash(digest, msg, msglen, &params, autoerase)) {
+				if (!cancelled)
+					fprintf(stderr, "%s: libar2_hash %.*s: %s\n", argv0, (int)stored_len, stored, strerror(errno));
+				ret = -1;
+			} else {
+				ret = digestequal(digest, tag, params.hashlen);
+			}
+			libar2_erase(digest, sizeof(digest));
+			libar2_erase(tag, sizeof(tag));
+			libar2_erase(salt, sizeof(salt));
+			return ret;
+		}
+	}
+
+	copy = strndup(stored, stored_len);
+	if (!copy) {
+		if (autoerase)
+			libar2_erase(msg, msglen);
+		fprintf(stderr, "%s: strndup: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	hash = key2root_crypt(msg, msglen, copy, autoerase);
+	ret = hash ? hashequal(hash, copy) : -1;
+	free(hash);
+	free(copy);
+	return ret;
+}
+
+
+static void
+prehash_init(struct libblake_blake2b_state *state, size_t keylen)
+{
+	struct libblake_blake2b_params params;
+
+	libblake_init();
+	memset(&params, 0, sizeof(params));
+	params.digest_len = KEY2ROOT_PREHASH_SIZE;
+	params.key_len = (uint_least8_t)keylen;
+	params.fanout = 1;
+	params.depth = 1;
+	libblake_blake2b_init(state, &params);
+}
+
+
+void
+key2root_keyed_prehash(unsigned char digest[KEY2ROOT_PREHASH_SIZE], const void *key, size_t keylen,
+                       const char *msg, size_t msglen)
+{
+	struct libblake_blake2b_state state;
+	unsigned char block[PREHASH_BLOCK];
+	size_t off;
+
+	prehash_init(&state, keylen);
+	if (keylen) {
+		/* the key is padded to a full block, which is the last block if the message is empty */
+		memset(block, 0, sizeof(block));
+		memcpy(block, key, keylen);
+		if (!msglen) {
+			libblake_blake2b_digest(&state, block, sizeof(block), 0, KEY2ROOT_PREHASH_SIZE, digest);
+			goto out;
+		}
+		libblake_blake2b_force_update(&state, block, sizeof(block));
+	}
+	/* all but the last block can be processed in place, the
+	 * last block is padded, so it is copied to a buffer */
+	off = libblake_blake2b_update(&state, msg, msglen);
+	memcpy(block, &msg[off], msglen - off);
+	libblake_blake2b_digest(&state, block, msglen - off, 0, KEY2ROOT_PREHASH_SIZE, digest);
+
+out:
+	libar2_erase(block, sizeof(block));
+	libar2_erase(&state, sizeof(state));
+}
+
+
+void
+key2root_prehash(unsigned char digest[KEY2ROOT_PREHASH_SIZE], const char *msg, size_t msglen)
+{
+	key2root_keyed_prehash(digest, NULL, 0, msg, msglen);
+}
+
+
+int
+key2root_prehash_fd(unsigned char digest[KEY2ROOT_PREHASH_SIZE], int fd)
+{
+	struct libblake_blake2b_state state;
+	unsigned char *buf;
+	size_t len = 0, off;
+	ssize_t r;
+	int ret = -1;
+
+	buf = mmap(NULL, PREHASH_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return -1;
+	mlock(buf, PREHASH_BUFFER_SIZE);
+
+	prehash_init(&state, 0);
+	for (;;) {
+		r = read(fd, &buf[len], PREHASH_BUFFER_SIZE - len);
+		if (r <= 0) {
+			if (r)
+				goto out;
+			break;
+		}
+		len += (size_t)r;
+		off = libblake_blake2b_update(&state, buf, len);
+		memmove(buf, &buf[off], len - off);
+		len -= off;
+	}
+	libblake_blake2b_digest(&state, buf, len, 0, KEY2ROOT_PREHASH_SIZE, digest);
+	ret = 0;
+
+out:
+	libar2_erase(&state, sizeof(state));
+	libar2_erase(buf, PREHASH_BUFFER_SIZE);
+	munmap(buf, PREHASH_BUFFER_SIZE);
+	return ret;
+}
+
+
+char *
+key2root_prehash_parameters(const char *paramstr)
+{
+	char *ret;
+
+	if (!paramstr)
+		paramstr = libar2simplified_recommendation(0);
+	if (key2root_prehashed(paramstr))
+		return strdup(paramstr);
+	ret = malloc(sizeof(KEY2ROOT_PREHASH_PREFIX) + strlen(paramstr));
+	if (ret)
+		stpcpy(stpcpy(ret, KEY2ROOT_PREHASH_PREFIX), paramstr);
+	return ret;
+}
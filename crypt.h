@@ -1,8 +1,40 @@
 /* See LICENSE file for copyright and license details. */
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <libar2.h>
 
+/* A key hash with this prefix is an Argon2 hash of the key's BLAKE2b digest,
+ * rather than of the key itself, so that the key can be hashed as a stream */
+#define KEY2ROOT_PREHASH_PREFIX "$blake2b"
+#define KEY2ROOT_PREHASH_SIZE 64
+
+int key2root_hash(void *hash, char *msg, size_t msglen, struct libar2_argon2_parameters *params, int autoerase);
 char *key2root_crypt(char *msg, size_t msglen, const char *paramstr, int autoerase);
+int key2root_verify(char *msg, size_t msglen, const char *stored, size_t stored_len, int autoerase);
+int key2root_crypt_differs(const char *hashstr, const char *paramstr);
+int key2root_crypt_cost(const char *paramstr, uint_least32_t *m_costp, uint_least32_t *t_costp, uint_least32_t *lanesp);
+int key2root_crypt_hash_cost(const char *stored, size_t stored_len,
+                             uint_least32_t *m_costp, uint_least32_t *t_costp, uint_least32_t *lanesp);
+void key2root_crypt_limit_threads(size_t n);
+void key2root_crypt_cancel(void);
+void key2root_crypt_resume(void);
+const char *key2root_crypt_kernel(void);
+void key2root_crypt_reserve(uint_least32_t m_cost);
+void key2root_crypt_release(void);
+void key2root_prehash(unsigned char digest[KEY2ROOT_PREHASH_SIZE], const char *msg, size_t msglen);
+void key2root_keyed_prehash(unsigned char digest[KEY2ROOT_PREHASH_SIZE], const void *key, size_t keylen,
+                            const char *msg, size_t msglen);
+int key2root_prehash_fd(unsigned char digest[KEY2ROOT_PREHASH_SIZE], int fd);
+char *key2root_prehash_parameters(const char *paramstr);
+
+
+static inline const char *
+key2root_prehashed(const char *hashstr)
+{
+	size_t n = sizeof(KEY2ROOT_PREHASH_PREFIX) - 1;
+	return strncmp(hashstr, KEY2ROOT_PREHASH_PREFIX"$", n + 1) ? NULL : &hashstr[n];
+}
 
 
 #define explicit_bzero key2root_erase
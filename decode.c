@@ -0,0 +1,104 @@
+/* See LICENSE file for copyright and license details. */
+#include "decode.h"
+#include <stdint.h>
+#include <string.h>
+
+
+static int
+decode_number(const char **sp, const char *end, uint_least32_t *valuep)
+{
+	const char *s = *sp;
+	uint_least32_t value = 0, digit;
+
+	/* leading zeroes are rejected, as they would not be encoded */
+	if (s == end || *s < '0' || *s > '9' || (*s == '0' && s + 1 != end && '0' <= s[1] && s[1] <= '9'))
+		return -1;
+	for (; s != end && '0' <= *s && *s <= '9'; s++) {
+		digit = (uint_least32_t)(*s - '0');
+		if (value > (UINT32_C(0xFFFFFFFF) - digit) / 10)
+			return -1;
+		value = value * 10 + digit;
+	}
+	*sp = s;
+	*valuep = value;
+	return 0;
+}
+
+
+static int
+decode_base64(const char **sp, const char *end, unsigned char *out, size_t max, size_t *lenp)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *s = *sp, *p;
+	uint_least32_t bits = 0;
+	size_t nbits = 0, len = 0;
+
+	for (; s != end && *s != '$'; s++) {
+		p = *s ? strchr(alphabet, *s) : NULL;
+		if (!p)
+			return -1;
+		bits = (bits << 6) | (uint_least32_t)(p - alphabet);
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			if (len == max)
+				return -1;
+			out[len++] = (unsigned char)(bits >> nbits);
+			bits &= ((uint_least32_t)1 << nbits) - 1;
+		}
+	}
+	/* padding bits must be zero, and a single trailing character cannot be decoded */
+	if (!len || nbits >= 6 || bits)
+		return -1;
+	*sp = s;
+	*lenp = len;
+	return 0;
+}
+
+
+int
+key2root_decode_hash(const char *s, const char *end, struct libar2_argon2_parameters *params,
+                     unsigned char salt[KEY2ROOT_VERIFY_MAX_SALT], unsigned char tag[KEY2ROOT_VERIFY_MAX_DIGEST])
+{
+	static const struct {
+		const char *prefix;
+		enum libar2_argon2_type type;
+	} types[] = {
+		{"$argon2id$v=", LIBAR2_ARGON2ID},
+		{"$argon2ds$v=", LIBAR2_ARGON2DS},
+		{"$argon2d$v=", LIBAR2_ARGON2D},
+		{"$argon2i$v=", LIBAR2_ARGON2I}
+	};
+	uint_least32_t version;
+	size_t i, n;
+
+	/* Only the form that libar2simplified_encode() produces is accepted, so that comparing
+	 * the digest is equivalent to comparing the encoded hash; anything else is left to libar2 */
+	memset(params, 0, sizeof(*params));
+	for (i = 0; i < sizeof(types) / sizeof(*types); i++) {
+		n = strlen(types[i].prefix);
+		if ((size_t)(end - s) > n && !memcmp(s, types[i].prefix, n))
+			break;
+	}
+	if (i == sizeof(types) / sizeof(*types))
+		return -1;
+	params->type = types[i].type;
+	s += n;
+
+	if (decode_number(&s, end, &version) || (version != 16 && version != 19))
+		return -1;
+	params->version = version == 16 ? LIBAR2_ARGON2_VERSION_10 : LIBAR2_ARGON2_VERSION_13;
+	if (end - s < 3 || memcmp(s, "$m=", 3) || (s += 3, decode_number(&s, end, &params->m_cost)))
+		return -1;
+	if (end - s < 3 || memcmp(s, ",t=", 3) || (s += 3, decode_number(&s, end, &params->t_cost)))
+		return -1;
+	if (end - s < 3 || memcmp(s, ",p=", 3) || (s += 3, decode_number(&s, end, &params->lanes)))
+		return -1;
+
+	if (s == end || *s++ != '$' || decode_base64(&s, end, salt, KEY2ROOT_VERIFY_MAX_SALT, &params->saltlen))
+		return -1;
+	if (s == end || *s++ != '$' || decode_base64(&s, end, tag, KEY2ROOT_VERIFY_MAX_DIGEST, &params->hashlen) || s != end)
+		return -1;
+	params->salt = salt;
+	return 0;
+}
@@ -0,0 +1,10 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <libar2.h>
+
+/* Large enough for the salt and digest of any key hash that is decoded without allocating */
+#define KEY2ROOT_VERIFY_MAX_SALT 256
+#define KEY2ROOT_VERIFY_MAX_DIGEST 1024
+
+int key2root_decode_hash(const char *s, const char *end, struct libar2_argon2_parameters *params,
+                         unsigned char salt[KEY2ROOT_VERIFY_MAX_SALT], unsigned char tag[KEY2ROOT_VERIFY_MAX_DIGEST]);
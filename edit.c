@@ -0,0 +1,906 @@
+/* See LICENSE file for copyright and license details. */
+#include "mapfile.h"
+#include "edit.h"
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "keydb.h"
+#include "scan.h"
+
+
+/* Changes to a user's key file are serialised by a lock on the user's queue
+ * directory, KEYPATH/<user>~q. key2root_submit leaves its changes in the queue
+ * before it waits for the lock, so that whichever process gets the lock can
+ * apply every queued change with one rewrite of the key file, and leave the
+ * result for the other processes to pick up. The ID of a request includes
+ * the PID of the process that made it, so that whatever a process leaves
+ * behind when it dies can be removed */
+#define QUEUE_SUFFIX "~q"
+#define RESULT_SUFFIX "~r"
+
+
+struct request {
+	char *id;
+	struct key2root_file file;
+	char *text;
+	struct key2root_change *changes;
+	size_t nchanges;
+	int failed;
+	char *log;
+	size_t log_len;
+};
+
+
+extern char *argv0;
+
+
+static int
+addsegment(struct key2root_edit *edit, const char *data, size_t len, size_t *sizep)
+{
+	struct key2root_segment *new;
+
+	if (!len)
+		return 0;
+	if (edit->nsegments && edit->segments[edit->nsegments - 1].data + edit->segments[edit->nsegments - 1].len == data) {
+		edit->segments[edit->nsegments - 1].len += len;
+		goto out;
+	}
+	if (edit->nsegments == *sizep) {
+		new = realloc(edit->segments, (*sizep = *sizep ? *sizep * 2 : 8) * sizeof(*edit->segments));
+		if (!new) {
+			fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+			return -1;
+		}
+		edit->segments = new;
+	}
+	edit->segments[edit->nsegments].data = data;
+	edit->segments[edit->nsegments].len = len;
+	edit->nsegments++;
+out:
+	edit->len += len;
+	return 0;
+}
+
+
+static struct key2root_change *
+findchange(struct key2root_edit *edit, const char *name, size_t len)
+{
+	struct key2root_change *change;
+	size_t i = (size_t)key2root_keydb_hash(name, len);
+
+	for (;; i++) {
+		i &= edit->table_mask;
+		if (!edit->table[i])
+			return NULL;
+		change = &edit->changes[edit->table[i] - 1];
+		if (change->keyname_len == len && !memcmp(change->keyname, name, len))
+			return change;
+	}
+}
+
+
+static int
+maketable(struct key2root_edit *edit)
+{
+	struct key2root_change *change;
+	size_t i, j, size = 4;
+
+	/* an open addressing table of change indices plus one, at most half full */
+	while (size < edit->nchanges * 2)
+		size <<= 1;
+	edit->table = calloc(size, sizeof(*edit->table));
+	if (!edit->table) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	edit->table_mask = size - 1;
+	for (i = 0; i < edit->nchanges; i++) {
+		edit->changes[i].next = NULL;
+		/* if a key name is listed twice, the changes are applied to one line each, in order */
+		change = findchange(edit, edit->changes[i].keyname, edit->changes[i].keyname_len);
+		if (change) {
+			while (change->next)
+				change = change->next;
+			change->next = &edit->changes[i];
+			continue;
+		}
+		j = (size_t)key2root_keydb_hash(edit->changes[i].keyname, edit->changes[i].keyname_len);
+		while (edit->table[j &= edit->table_mask])
+			j++;
+		edit->table[j] = i + 1;
+	}
+	return 0;
+}
+
+
+static int
+makelines(struct key2root_edit *edit)
+{
+	struct key2root_change *change;
+	size_t i, size = 0;
+	char *p;
+
+	for (i = 0; i < edit->nchanges; i++) {
+		change = &edit->changes[i];
+		change->keyname_len = strlen(change->keyname);
+		change->found = 0;
+		if (change->hash)
+			size += change->keyname_len + strlen(change->hash) + 2;
+	}
+	p = edit->lines = malloc(size + 1);
+	if (!p) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < edit->nchanges; i++) {
+		change = &edit->changes[i];
+		change->line = p;
+		if (change->hash)
+			p = stpcpy(stpcpy(stpcpy(stpcpy(p, change->keyname), " "), change->hash), "\n");
+		change->line_len = (size_t)(p - change->line);
+	}
+	return maketable(edit);
+}
+
+
+static void
+initedit(struct key2root_edit *edit)
+{
+	edit->path = NULL;
+	edit->file.data = NULL;
+	edit->file.len = 0;
+	edit->file.size = 0;
+	edit->file.mapped = 0;
+	edit->lines = NULL;
+	edit->table = NULL;
+	edit->segments = NULL;
+	edit->nsegments = 0;
+	edit->len = 0;
+}
+
+
+static char *
+userpath(const char *user, const char *suffix)
+{
+	char *path = malloc(sizeof(KEYPATH"/") + strlen(user) + strlen(suffix));
+	if (!path) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return NULL;
+	}
+	stpcpy(stpcpy(stpcpy(path, KEYPATH"/"), user), suffix);
+	return path;
+}
+
+
+static int
+loaduserfile(const char *path, struct key2root_file *file)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, path, strerror(errno));
+		return -1;
+	}
+	if (key2root_load_file(fd, file)) {
+		fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (close(fd)) {
+		fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+static int
+linehas(const char *hash, const char *end, const char *expect)
+{
+	size_t len = strlen(expect);
+	return (size_t)(end - hash) == len && !memcmp(hash, expect, len);
+}
+
+
+/* Works out the new content of a key file, as a list of segments of
+ * the old content and new lines, without copying anything. Problems
+ * with the changes are reported to `log`, and problems with the file
+ * to the standard error if `warn` is set */
+static int
+plan(struct key2root_edit *edit, const char *data, size_t datalen, FILE *log, int warn)
+{
+	struct key2root_change *change;
+	struct key2root_scanner scanner;
+	struct key2root_line line;
+	size_t size = 0, i;
+	int failed = 0;
+
+	key2root_scan_init(&scanner, data, datalen);
+	while (key2root_scan_line(&scanner, &line)) {
+		change = NULL;
+		if (line.has_nul) {
+			if (warn)
+				fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, edit->path, line.lineno);
+		} else if (!line.sp) {
+			if (warn)
+				fprintf(stderr, "%s: no SP byte found in %s on line %zu\n", argv0, edit->path, line.lineno);
+		} else {
+			/* a change applies only to the first line with the key name, later lines are kept,
+			 * and a conditional change is dropped if the key has been changed by someone else */
+			change = findchange(edit, line.data, (size_t)(line.sp - line.data));
+			while (change && (change->found ||
+			                  (change->expect && !linehas(&line.sp[1], &line.data[line.len], change->expect))))
+				change = change->next;
+		}
+
+		if (!change) {
+			if (addsegment(edit, line.data, line.len + 1, &size))
+				return -1;
+		} else {
+			/* the new line takes the place of the old line */
+			change->found = 1;
+			if (change->hash && !change->force) {
+				fprintf(log, "%s: key already exists for %s: %s\n", argv0, edit->user, change->keyname);
+				failed = 1;
+			}
+			if (addsegment(edit, change->line, change->line_len, &size))
+				return -1;
+		}
+	}
+
+	for (i = 0; i < edit->nchanges; i++) {
+		change = &edit->changes[i];
+		if (change->found || change->expect)
+			continue;
+		if (!change->hash) {
+			if (!change->force) {
+				fprintf(log, "%s: key not found for %s: %s\n", argv0, edit->user, change->keyname);
+				failed = 1;
+			}
+		} else if (addsegment(edit, change->line, change->line_len, &size)) {
+			return -1;
+		}
+	}
+
+	if (scanner.pos != datalen) {
+		/* new lines are added before the truncated line so that they are not concatenated onto it */
+		if (warn) {
+			fprintf(stderr, "%s: file truncated: %s\n", argv0, edit->path);
+			if (memchr(&data[scanner.pos], '\0', datalen - scanner.pos))
+				fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, edit->path, scanner.lineno + 1);
+		}
+		if (addsegment(edit, &data[scanner.pos], datalen - scanner.pos, &size))
+			return -1;
+	}
+
+	return -failed;
+}
+
+
+static int
+writeall(int fd, const char *data, size_t len)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < len) {
+		r = write(fd, &data[off], len - off);
+		if (r < 0)
+			return -1;
+		off += (size_t)r;
+	}
+
+	return 0;
+}
+
+
+/* Must only be called with the user's lock held, which is why a
+ * temporary file left behind by a crashed writer can be truncated */
+static int
+writefile(const char *path, const struct key2root_segment *segments, size_t nsegments, size_t len)
+{
+	char *path2;
+	size_t i;
+	int fd;
+
+	if (!len) {
+		if (unlink(path) && errno != ENOENT) {
+			fprintf(stderr, "%s: unlink %s: %s\n", argv0, path, strerror(errno));
+			return -1;
+		}
+		goto compile;
+	}
+
+	path2 = malloc(strlen(path) + 2);
+	if (!path2) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	stpcpy(stpcpy(path2, path), "~");
+	fd = open(path2, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open %s O_WRONLY|O_CREAT|O_TRUNC 0600: %s\n", argv0, path2, strerror(errno));
+		free(path2);
+		return -1;
+	}
+	for (i = 0; i < nsegments; i++) {
+		if (writeall(fd, segments[i].data, segments[i].len)) {
+			fprintf(stderr, "%s: write %s: %s\n", argv0, path2, strerror(errno));
+			close(fd);
+			goto saved_failed;
+		}
+	}
+	if (fsync(fd)) {
+		fprintf(stderr, "%s: fsync %s: %s\n", argv0, path2, strerror(errno));
+		close(fd);
+		goto saved_failed;
+	}
+	if (close(fd)) {
+		fprintf(stderr, "%s: write %s: %s\n", argv0, path2, strerror(errno));
+		goto saved_failed;
+	}
+	if (rename(path2, path)) {
+		fprintf(stderr, "%s: rename %s %s: %s\n", argv0, path2, path, strerror(errno));
+	saved_failed:
+		if (unlink(path2))
+			fprintf(stderr, "%s: unlink %s: %s\n", argv0, path2, strerror(errno));
+		free(path2);
+		return -1;
+	}
+	free(path2);
+
+compile:
+	if (key2root_recompile_keydb(path))
+		fprintf(stderr, "%s: compile %s%s: %s\n", argv0, path, KEY2ROOT_KEYDB_SUFFIX, strerror(errno));
+	return 0;
+}
+
+
+static int
+openqueue(const char *user)
+{
+	char *path;
+	int fd;
+
+	if (mkdir(KEYPATH, 0700) && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir %s: %s\n", argv0, KEYPATH, strerror(errno));
+		return -1;
+	}
+	path = userpath(user, QUEUE_SUFFIX);
+	if (!path)
+		return -1;
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		fprintf(stderr, "%s: mkdir %s: %s\n", argv0, path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		fprintf(stderr, "%s: open %s O_RDONLY|O_DIRECTORY: %s\n", argv0, path, strerror(errno));
+	free(path);
+	return fd;
+}
+
+
+static int
+lockqueue(int fd, const char *user)
+{
+	while (flock(fd, LOCK_EX)) {
+		if (errno != EINTR) {
+			fprintf(stderr, "%s: flock %s/%s%s LOCK_EX: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int
+key2root_lock(const char *user)
+{
+	int fd = openqueue(user);
+	if (fd >= 0 && lockqueue(fd, user)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+void
+key2root_unlock(int lock)
+{
+	close(lock);
+}
+
+
+/* The user's lock must be held from key2root_prepare until key2root_commit */
+int
+key2root_prepare(struct key2root_edit *edit)
+{
+	initedit(edit);
+	edit->path = userpath(edit->user, "");
+	if (!edit->path || makelines(edit) || loaduserfile(edit->path, &edit->file))
+		return -1;
+	return plan(edit, edit->file.data, edit->file.len, stderr, 1);
+}
+
+
+int
+key2root_commit(struct key2root_edit *edit)
+{
+	return writefile(edit->path, edit->segments, edit->nsegments, edit->len);
+}
+
+
+/* Makes renames and unlinks by key2root_commit durable */
+int
+key2root_sync(void)
+{
+	int fd = open(KEYPATH, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd)) {
+		fprintf(stderr, "%s: fsync %s: %s\n", argv0, KEYPATH, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+
+void
+key2root_discard(struct key2root_edit *edit)
+{
+	key2root_unload_file(&edit->file);
+	free(edit->path);
+	free(edit->lines);
+	free(edit->table);
+	free(edit->segments);
+	edit->path = NULL;
+	edit->lines = NULL;
+	edit->table = NULL;
+	edit->segments = NULL;
+}
+
+
+static int
+enqueue(int dir, const char *user, char *id, struct key2root_change *changes, size_t nchanges)
+{
+	static unsigned long int counter = 0;
+	struct timespec now;
+	char tmp[128];
+	FILE *f;
+	size_t i;
+	int fd;
+
+	/* request IDs sort in the order the requests were made */
+	clock_gettime(CLOCK_REALTIME, &now);
+	sprintf(id, "%020ju.%09ld.%010ju.%lu", (uintmax_t)now.tv_sec, now.tv_nsec, (uintmax_t)getpid(), counter++);
+	stpcpy(stpcpy(tmp, id), "~");
+
+	fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		fprintf(stderr, "%s: open %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	for (i = 0; i < nchanges; i++) {
+		if (changes[i].expect)
+			fprintf(f, "u %s %s %s\n", changes[i].keyname, changes[i].expect, changes[i].hash);
+		else if (changes[i].hash)
+			fprintf(f, "%c %s %s\n", changes[i].force ? 'r' : 'a', changes[i].keyname, changes[i].hash);
+		else
+			fprintf(f, "%c %s\n", changes[i].force ? 'D' : 'd', changes[i].keyname);
+	}
+	if (fflush(f) || ferror(f) || fclose(f) || renameat(dir, tmp, dir, id)) {
+		fprintf(stderr, "%s: write %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, tmp, strerror(errno));
+		unlinkat(dir, tmp, 0);
+		return -1;
+	}
+	return 0;
+}
+
+
+static int
+loadrequest(int dir, struct request *request)
+{
+	struct key2root_change *change;
+	char *line, *next, *sp;
+	size_t n = 0;
+	int fd;
+
+	fd = openat(dir, request->id, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (key2root_load_file(fd, &request->file)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	request->text = malloc(request->file.len + 1);
+	request->changes = calloc(request->file.len / 2 + 1, sizeof(*request->changes));
+	if (!request->text || !request->changes)
+		return -1;
+	memcpy(request->text, request->file.data, request->file.len);
+	request->text[request->file.len] = '\0';
+
+	for (line = request->text; *line; line = next) {
+		next = strchr(line, '\n');
+		if (!next || line[0] == '\0' || line[1] != ' ') {
+			errno = EBADMSG;
+			return -1;
+		}
+		*next++ = '\0';
+		change = &request->changes[n++];
+		change->force = line[0] == 'r' || line[0] == 'D' || line[0] == 'u';
+		change->keyname = &line[2];
+		sp = strchr(&line[2], ' ');
+		if (sp)
+			*sp++ = '\0';
+		if (line[0] == 'u') {
+			/* u <key name> <expected hash> <new hash> */
+			change->expect = sp;
+			sp = sp ? strchr(sp, ' ') : NULL;
+			if (sp)
+				*sp++ = '\0';
+		}
+		change->hash = (line[0] == 'a' || line[0] == 'r' || line[0] == 'u') ? sp : NULL;
+		if ((line[0] == 'a' || line[0] == 'r' || line[0] == 'u') != !!sp) {
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+	request->nchanges = n;
+	return 0;
+}
+
+
+static int
+cmprequests(const void *av, const void *bv)
+{
+	const struct request *a = av, *b = bv;
+	return strcmp(a->id, b->id);
+}
+
+
+/* Checks whether the process that made a request has exited, name is the
+ * request's ID, possibly followed by a suffix */
+static int
+abandoned(const char *name)
+{
+	const char *p;
+	uintmax_t pid;
+
+	p = strchr(name, '.');
+	p = p ? strchr(&p[1], '.') : NULL;
+	if (!p)
+		return 0;
+	pid = strtoumax(&p[1], NULL, 10);
+	if (!pid || (uintmax_t)(pid_t)pid != pid)
+		return 0;
+	return kill((pid_t)pid, 0) && errno == ESRCH;
+}
+
+
+/* Removes the results and partial requests left by processes that
+ * have exited; the lock on the queue must be held */
+static void
+sweepqueue(int dir)
+{
+	struct dirent *f;
+	DIR *d;
+
+	/* the duplicate shares its offset with dir, so start from the beginning */
+	d = fdopendir(dup(dir));
+	if (!d)
+		return;
+	rewinddir(d);
+	while ((f = readdir(d)))
+		if (f->d_name[0] != '.' && strchr(f->d_name, '~') && abandoned(f->d_name))
+			unlinkat(dir, f->d_name, 0);
+	closedir(d);
+}
+
+
+static size_t
+listqueue(int dir, struct request **requestsp)
+{
+	struct request *requests = NULL, *new;
+	size_t n = 0, size = 0;
+	struct dirent *f;
+	DIR *d;
+
+	d = fdopendir(dup(dir));
+	if (!d)
+		return SIZE_MAX;
+	rewinddir(d);
+	while ((errno = 0, f = readdir(d))) {
+		/* skip temporary files and results, as well as . and .. */
+		if (f->d_name[0] == '.' || strchr(f->d_name, '~'))
+			continue;
+		/* no one would pick up the result of a request from a process that has exited */
+		if (abandoned(f->d_name)) {
+			unlinkat(dir, f->d_name, 0);
+			continue;
+		}
+		if (n == size) {
+			new = realloc(requests, (size = size ? size * 2 : 8) * sizeof(*requests));
+			if (!new)
+				goto fail;
+			requests = new;
+		}
+		memset(&requests[n], 0, sizeof(*requests));
+		requests[n].id = strdup(f->d_name);
+		if (!requests[n++].id)
+			goto fail;
+	}
+	if (errno)
+		goto fail;
+	closedir(d);
+	qsort(requests, n, sizeof(*requests), cmprequests);
+	*requestsp = requests;
+	return n;
+
+fail:
+	closedir(d);
+	while (n--)
+		free(requests[n].id);
+	free(requests);
+	return SIZE_MAX;
+}
+
+
+static void
+freerequest(struct request *request)
+{
+	key2root_unload_file(&request->file);
+	free(request->id);
+	free(request->text);
+	free(request->changes);
+	free(request->log);
+}
+
+
+/* Applies all queued changes, in order, with a single rewrite of the
+ * key file; a request that cannot be applied is rejected as a whole */
+static int
+lead(int dir, const char *user, struct request **requestsp, size_t *nrequestsp)
+{
+	struct key2root_edit edit;
+	struct key2root_segment segment;
+	struct key2root_file file = {NULL, 0, 0, 0};
+	struct request *requests, *request;
+	size_t i, j, n;
+	int modified = 0;
+	char *path, *data, *current;
+	size_t len;
+	FILE *log;
+
+	n = listqueue(dir, &requests);
+	if (n == SIZE_MAX) {
+		fprintf(stderr, "%s: readdir %s/%s%s/: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, strerror(errno));
+		return -1;
+	}
+	*requestsp = requests;
+	*nrequestsp = n;
+
+	path = userpath(user, "");
+	if (!path || loaduserfile(path, &file)) {
+		free(path);
+		return -1;
+	}
+	current = file.data;
+	len = file.len;
+	data = NULL;
+
+	for (i = 0; i < n; i++) {
+		request = &requests[i];
+		log = open_memstream(&request->log, &request->log_len);
+		if (!log) {
+			fprintf(stderr, "%s: open_memstream: %s\n", argv0, strerror(errno));
+			goto fail;
+		}
+		if (loadrequest(dir, request)) {
+			fprintf(log, "%s: read %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, request->id, strerror(errno));
+			request->failed = 1;
+			fclose(log);
+			continue;
+		}
+		initedit(&edit);
+		edit.user = user;
+		edit.path = path;
+		edit.changes = request->changes;
+		edit.nchanges = request->nchanges;
+		if (makelines(&edit)) {
+			free(edit.lines);
+			goto fail_log;
+		}
+		request->failed = !!plan(&edit, current, len, log, !i);
+		if (!request->failed) {
+			/* the file is rebuilt in memory for each request, but written only once */
+			current = malloc(edit.len + 1);
+			if (!current) {
+				fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+				free(edit.lines);
+				free(edit.table);
+				free(edit.segments);
+				goto fail_log;
+			}
+			for (len = 0, j = 0; j < edit.nsegments; len += edit.segments[j++].len)
+				memcpy(&current[len], edit.segments[j].data, edit.segments[j].len);
+			free(data);
+			data = current;
+			for (j = 0; j < edit.nchanges; j++)
+				if ((edit.changes[j].hash && !edit.changes[j].expect) || edit.changes[j].found)
+					modified = 1;
+		}
+		free(edit.lines);
+		free(edit.table);
+		free(edit.segments);
+		fclose(log);
+	}
+
+	if (modified) {
+		segment.data = current;
+		segment.len = len;
+		if (writefile(path, &segment, 1, len) || key2root_sync()) {
+			for (i = 0; i < n; i++) {
+				if (!requests[i].failed) {
+					requests[i].failed = 1;
+					free(requests[i].log);
+					requests[i].log = NULL;
+					if (asprintf(&requests[i].log, "%s: could not write %s\n", argv0, path) < 0)
+						requests[i].log = NULL;
+					requests[i].log_len = requests[i].log ? strlen(requests[i].log) : 0;
+				}
+			}
+		}
+	}
+
+	free(data);
+	free(path);
+	key2root_unload_file(&file);
+	return 0;
+
+fail_log:
+	fclose(log);
+fail:
+	free(data);
+	free(path);
+	key2root_unload_file(&file);
+	return -1;
+}
+
+
+static int
+writeresult(int dir, const char *user, const struct request *request)
+{
+	char name[128 + sizeof(RESULT_SUFFIX)];
+	size_t i;
+	FILE *f;
+	int fd;
+
+	/* the result is picked up by the process that made the request once it gets the lock */
+	stpcpy(stpcpy(name, request->id), RESULT_SUFFIX);
+	fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		fprintf(stderr, "%s: open %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	fputc(request->failed ? '1' : '0', f);
+	for (i = 0; i < request->nchanges; i++)
+		fputc(request->changes[i].found ? '1' : '0', f);
+	fputc('\n', f);
+	if (request->log_len)
+		fwrite(request->log, 1, request->log_len, f);
+	if (fflush(f) || ferror(f) || fclose(f)) {
+		fprintf(stderr, "%s: write %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+static int
+readresult(int fd, struct key2root_change *changes, size_t nchanges)
+{
+	struct key2root_file file;
+	const char *nl;
+	size_t i;
+	int ret;
+
+	if (key2root_load_file(fd, &file))
+		return -1;
+	nl = memchr(file.data, '\n', file.len);
+	if (!nl || (size_t)(nl - file.data) != nchanges + 1) {
+		key2root_unload_file(&file);
+		errno = EBADMSG;
+		return -1;
+	}
+	ret = file.data[0] == '0' ? 0 : -1;
+	for (i = 0; i < nchanges; i++)
+		changes[i].found = file.data[i + 1] == '1';
+	fwrite(&nl[1], 1, file.len - (size_t)(nl + 1 - file.data), stderr);
+	key2root_unload_file(&file);
+	return ret;
+}
+
+
+/* Applies the changes to the user's key file, together with any changes
+ * made to it concurrently by other processes, and waits until they are
+ * on disk. Either all of the changes are made, or none of them is */
+int
+key2root_submit(const char *user, struct key2root_change *changes, size_t nchanges)
+{
+	struct request *requests = NULL;
+	size_t nrequests = 0, i, j;
+	char id[128], result[128 + sizeof(RESULT_SUFFIX)];
+	int dir, fd, ret = -1;
+
+	dir = openqueue(user);
+	if (dir < 0)
+		return -1;
+	if (enqueue(dir, user, id, changes, nchanges)) {
+		close(dir);
+		return -1;
+	}
+	if (lockqueue(dir, user)) {
+		unlinkat(dir, id, 0);
+		close(dir);
+		return -1;
+	}
+	sweepqueue(dir);
+
+	stpcpy(stpcpy(result, id), RESULT_SUFFIX);
+	fd = openat(dir, result, O_RDONLY);
+	if (fd >= 0) {
+		/* another process has already made the changes */
+		ret = readresult(fd, changes, nchanges);
+		if (ret && errno == EBADMSG)
+			fprintf(stderr, "%s: read %s/%s%s/%s: %s\n", argv0, KEYPATH, user, QUEUE_SUFFIX, result, strerror(errno));
+		close(fd);
+		unlinkat(dir, result, 0);
+		goto out;
+	}
+
+	if (lead(dir, user, &requests, &nrequests)) {
+		/* leave the other requests for the next process to get the lock */
+		unlinkat(dir, id, 0);
+		goto out;
+	}
+	for (i = 0; i < nrequests; i++) {
+		if (!strcmp(requests[i].id, id)) {
+			if (requests[i].log_len)
+				fwrite(requests[i].log, 1, requests[i].log_len, stderr);
+			for (j = 0; j < nchanges && j < requests[i].nchanges; j++)
+				changes[j].found = requests[i].changes[j].found;
+			ret = -requests[i].failed;
+		} else {
+			writeresult(dir, user, &requests[i]);
+		}
+		unlinkat(dir, requests[i].id, 0);
+	}
+
+out:
+	for (i = 0; i < nrequests; i++)
+		freerequest(&requests[i]);
+	free(requests);
+	key2root_unlock(dir);
+	return ret;
+}
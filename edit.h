@@ -0,0 +1,42 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+
+struct key2root_change {
+	const char *keyname;
+	const char *hash; /* NULL to remove the key */
+	const char *expect; /* if not NULL, only a line with this hash is replaced, and only if it exists */
+	int force; /* whether an existing key may be replaced, or a missing key be removed */
+	int found; /* set by key2root_prepare and key2root_submit */
+	size_t keyname_len;
+	char *line;
+	size_t line_len;
+	struct key2root_change *next; /* the next change with the same key name */
+};
+
+struct key2root_segment {
+	const char *data;
+	size_t len;
+};
+
+/* Requires mapfile.h */
+struct key2root_edit {
+	const char *user;
+	struct key2root_change *changes;
+	size_t nchanges;
+	char *path;
+	struct key2root_file file;
+	char *lines;
+	size_t *table;
+	size_t table_mask;
+	struct key2root_segment *segments;
+	size_t nsegments;
+	size_t len;
+};
+
+int key2root_lock(const char *user);
+void key2root_unlock(int lock);
+int key2root_prepare(struct key2root_edit *edit);
+int key2root_commit(struct key2root_edit *edit);
+int key2root_sync(void);
+void key2root_discard(struct key2root_edit *edit);
+int key2root_submit(const char *user, struct key2root_change *changes, size_t nchanges);
@@ -0,0 +1,112 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crypt.h"
+#include "forward.h"
+#include "readkey.h"
+
+
+#define DIRECT_MAX     (64UL << 20)
+#define SNDBUF_OVERHEAD (64 << 10)
+
+
+extern char *argv0;
+
+
+static size_t
+forward_direct(int fd, const char *data, size_t len)
+{
+	size_t off, bufsize = len < DIRECT_MAX ? len : DIRECT_MAX;
+	int size;
+	ssize_t r;
+
+	/* The kernel doubles the requested size (for its own bookkeeping), but
+	 * the data is also split into segments of at most half of the buffer.
+	 * The size is capped by net.core.wmem_max, as the memory cannot be
+	 * swapped out, and whatever does not fit is sent by forward_fork() */
+	size = (int)(bufsize + SNDBUF_OVERHEAD);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	for (off = 0; off < len; off += (size_t)r) {
+		r = send(fd, &data[off], len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r <= 0)
+			break;
+	}
+	return off;
+}
+
+
+static int
+forward_fork(int fd, struct key2root_key *key, size_t off)
+{
+	ssize_t r;
+
+	switch (fork()) {
+	case -1:
+		fprintf(stderr, "%s: fork: %s\n", argv0, strerror(errno));
+		return -1;
+	case 0:
+		if (mlockall(MCL_CURRENT))
+			fprintf(stderr, "%s: mlockall MCL_CURRENT: %s\n", argv0, strerror(errno));
+		break;
+	default:
+		return 0;
+	}
+
+	for (; off < key->len; off += (size_t)r) {
+		r = write(fd, &key->data[off], key->len - off);
+		if (r < 0) {
+			fprintf(stderr, "%s: write <socket>: %s\n", argv0, strerror(errno));
+			close(fd);
+			_exit(1);
+		}
+		if (!key->from_file)
+			explicit_bzero(&key->data[off], (size_t)r);
+	}
+
+	close(fd);
+	_exit(0);
+}
+
+
+int
+key2root_forward(struct key2root_key *key, int direct)
+{
+	int fds[2];
+	size_t off = 0;
+
+	/* We are using sockets because they cannot be hijacked via /proc/<pid>/fd/ */
+
+	if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fds)) {
+		fprintf(stderr, "%s: socketpair PF_LOCAL SOCK_STREAM 0: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	if (shutdown(fds[0], SHUT_WR)) {
+		fprintf(stderr, "%s: shutdown <socket> SHUT_WR: %s\n", argv0, strerror(errno));
+		goto fail;
+	}
+	if (shutdown(fds[1], SHUT_RD)) {
+		fprintf(stderr, "%s: shutdown <socket> SHUT_RD: %s\n", argv0, strerror(errno));
+		goto fail;
+	}
+
+	/* Unless the key is large, it will fit in the socket's send buffer,
+	 * so no process needs to be forked to feed it to the command */
+	if (direct)
+		off = forward_direct(fds[1], key->data, key->len);
+	if (off < key->len && forward_fork(fds[1], key, off))
+		goto fail;
+
+	close(fds[1]);
+	return fds[0];
+
+fail:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
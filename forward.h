@@ -0,0 +1,4 @@
+/* See LICENSE file for copyright and license details. */
+struct key2root_key;
+
+int key2root_forward(struct key2root_key *key, int direct);
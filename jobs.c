@@ -0,0 +1,100 @@
+/* See LICENSE file for copyright and license details. */
+#include "jobs.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+struct jobs {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t njobs;
+	size_t next;
+	size_t stopped_by;
+	size_t in_use;
+	size_t budget;
+	const size_t *costs;
+	int (*run)(size_t job, void *user);
+	void *user;
+};
+
+
+static void *
+worker(void *data)
+{
+	struct jobs *jobs = data;
+	size_t job, cost;
+	int stop;
+
+	pthread_mutex_lock(&jobs->mutex);
+	while (jobs->next < jobs->njobs && jobs->stopped_by == jobs->njobs) {
+		cost = jobs->costs ? jobs->costs[jobs->next] : 1;
+		if (cost > jobs->budget)
+			cost = jobs->budget;
+		/* a job that is more expensive than the budget is allowed to run alone */
+		if (jobs->in_use && jobs->in_use + cost > jobs->budget) {
+			pthread_cond_wait(&jobs->cond, &jobs->mutex);
+			continue;
+		}
+		job = jobs->next++;
+		jobs->in_use += cost;
+		pthread_mutex_unlock(&jobs->mutex);
+
+		stop = jobs->run(job, jobs->user);
+
+		pthread_mutex_lock(&jobs->mutex);
+		jobs->in_use -= cost;
+		if (stop && jobs->stopped_by == jobs->njobs)
+			jobs->stopped_by = job;
+		pthread_cond_broadcast(&jobs->cond);
+	}
+	pthread_mutex_unlock(&jobs->mutex);
+
+	return NULL;
+}
+
+
+/* Runs jobs in order on up to `nworkers` threads (including the calling
+ * thread), starting a job only when the total cost of the running jobs
+ * stays within `budget` (0 for unlimited), or when no other job is running.
+ * If `run` returns non-zero, no further jobs are started. Returns the
+ * index of the job that stopped the run, or `njobs` if none did. */
+size_t
+key2root_run_jobs(size_t njobs, size_t nworkers, size_t budget, const size_t *costs,
+                  int (*run)(size_t job, void *user), void *user)
+{
+	struct jobs jobs;
+	pthread_t *threads = NULL;
+	size_t i, nthreads = 0;
+
+	jobs.njobs = njobs;
+	jobs.next = 0;
+	jobs.stopped_by = njobs;
+	jobs.in_use = 0;
+	jobs.budget = budget ? budget : SIZE_MAX;
+	jobs.costs = costs;
+	jobs.run = run;
+	jobs.user = user;
+	pthread_mutex_init(&jobs.mutex, NULL);
+	pthread_cond_init(&jobs.cond, NULL);
+
+	if (nworkers > njobs)
+		nworkers = njobs;
+	if (nworkers > 1)
+		threads = calloc(nworkers - 1, sizeof(*threads));
+	/* if threads cannot be created, the calling thread does the work with fewer or no helpers */
+	if (threads)
+		for (; nthreads < nworkers - 1; nthreads++)
+			if (pthread_create(&threads[nthreads], NULL, worker, &jobs))
+				break;
+
+	worker(&jobs);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	pthread_cond_destroy(&jobs.cond);
+	pthread_mutex_destroy(&jobs.mutex);
+	return jobs.stopped_by;
+}
@@ -0,0 +1,5 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+
+size_t key2root_run_jobs(size_t njobs, size_t nworkers, size_t budget, const size_t *costs,
+                         int (*run)(size_t job, void *user), void *user);
@@ -1,5 +1,6 @@
 /* See LICENSE file for copyright and license details. */
 #include <sys/stat.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -7,114 +8,381 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <libar2simplified.h>
 
 #include "arg.h"
+#include "cache.h"
+#include "conf.h"
 #include "crypt.h"
+#include "jobs.h"
+#include "keydb.h"
+#include "mapfile.h"
+#include "edit.h"
+#include "readkey.h"
+#include "tune.h"
 
 
 char *argv0;
 
+static struct key2root_config conf;
+
+
+struct operation {
+	size_t lineno;
+	const char *user;
+	const char *keyname;
+	const char *keyfile; /* NULL to remove the key */
+	const char *parameters;
+	int replace;
+	size_t key;
+};
+
+struct keyhash {
+	const char *keyfile;
+	const char *parameters;
+	char *hash;
+};
+
+struct target {
+	struct key2root_edit edit;
+	size_t lineno;
+	int lock;
+	int failed;
+};
+
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-r] (user key-name [crypt-parameters] | -h user key-name key-hash)\n", argv0);
+	fprintf(stderr, "usage: %s [-r] ([-s] user key-name [crypt-parameters] | [-s] -t milliseconds [-m max-memory] [-p lanes] user key-name | -h user key-name key-hash)\n"
+	                "       %s -f manifest\n", argv0, argv0);
 	exit(1);
 }
 
 
 static int
-writeall(int fd, const char *data, size_t len)
+cmpbyuser(const void *av, const void *bv)
 {
-	size_t off = 0;
-	ssize_t r;
-
-	while (off < len) {
-		r = write(fd, &data[off], len - off);
-		if (r < 0)
-			return -1;
-		off += (size_t)r;
-	}
-
-	return 0;
+	const struct operation *a = av, *b = bv;
+	int r = strcmp(a->user, b->user);
+	if (!r)
+		r = strcmp(a->keyname, b->keyname);
+	return r ? r : a->lineno < b->lineno ? -1 : a->lineno > b->lineno;
 }
 
 
 static int
-checkkey(char *data, size_t whead, size_t *rheadp, size_t *rhead2p, size_t *linenop,
-         const char *keyname, size_t klen, const char *path)
+cmpbykey(const void *av, const void *bv)
 {
-	int failed = 0;
-	size_t len;
+	const struct operation *a = *(struct operation *const *)av, *b = *(struct operation *const *)bv;
+	int r = strcmp(a->keyfile, b->keyfile);
+	return r ? r : strcmp(a->parameters ? a->parameters : "", b->parameters ? b->parameters : "");
+}
 
-	while (*rhead2p < whead && data[*rhead2p] != '\n')
-		++*rhead2p;
 
-	if (data[*rhead2p] != '\n')
-		return 0;
+static int
+cmpbyline(const void *av, const void *bv)
+{
+	const struct target *a = av, *b = bv;
+	return a->lineno < b->lineno ? -1 : a->lineno > b->lineno;
+}
 
-	len = *rhead2p - *rheadp;
-	*linenop += 1;
 
-	if (memchr(&data[*rheadp], '\0', len)) {
-		fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, *linenop);
-		failed = 1;
-	}
-	if (!memchr(&data[*rheadp], ' ', len)) {
-		fprintf(stderr, "%s: no SP byte found in %s on line %zu\n", argv0, path, *linenop);
-		failed = 1;
-	}
+static int
+hashkey(size_t i, void *user)
+{
+	struct keyhash *key = &((struct keyhash *)user)[i];
+	struct key2root_key input;
+	unsigned char digest[KEY2ROOT_PREHASH_SIZE];
+	int fd;
 
-	if (failed || klen >= len || data[*rheadp + klen] != ' ' || memcmp(&data[*rheadp], keyname, klen)) {
-		*rheadp = ++*rhead2p;
-		return 0;
-	} else {
-		++*rhead2p;
+	fd = open(key->keyfile, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, key->keyfile, strerror(errno));
 		return 1;
 	}
+	if (key->parameters && key2root_prehashed(key->parameters)) {
+		if (key2root_prehash_fd(digest, fd)) {
+			fprintf(stderr, "%s: read %s: %s\n", argv0, key->keyfile, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		key->hash = key2root_crypt((char *)digest, sizeof(digest), key->parameters, 1);
+	} else {
+		if (key2root_read_key(fd, &input, 1)) {
+			fprintf(stderr, "%s: read %s: %s\n", argv0, key->keyfile, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		key->hash = key2root_crypt(input.data, input.len, key->parameters, !input.from_file);
+		key2root_free_key(&input);
+	}
+	close(fd);
+	return !key->hash;
 }
 
 
-static void
-loadandlocate(size_t *beginning_out, size_t *end_out, int fd, char **datap, size_t *lenp, size_t *sizep,
-              const char *keyname, const char *path)
+/* Returns the name of the setting in the configuration file that key hashes made
+ * with the parameters would exceed, so that key2root would not check them */
+static const char *
+exceeds(const char *parameters)
+{
+	uint_least32_t m_cost, t_cost, lanes;
+
+	if (key2root_crypt_cost(parameters ? parameters : libar2simplified_recommendation(0), &m_cost, &t_cost, &lanes))
+		return NULL;
+	return key2root_exceeds_limits(&conf, m_cost, t_cost, lanes);
+}
+
+
+static int
+preparetarget(size_t i, void *user)
+{
+	struct target *target = &((struct target *)user)[i];
+	target->failed = !!key2root_prepare(&target->edit);
+	return 0;
+}
+
+
+static int
+committarget(size_t i, void *user)
+{
+	struct target *target = &((struct target *)user)[i];
+	target->failed = !!key2root_commit(&target->edit);
+	return 0;
+}
+
+
+static size_t
+parsemanifest(char *data, const char *path, struct operation **opsp)
 {
-	size_t klen = strlen(keyname);
-	char *new;
-	size_t rhead = 0;
-	size_t rhead2 = 0;
-	size_t lineno = 0;
-	ssize_t r = 1;
-
-	while (r) {
-		if (*lenp == *sizep) {
-			new = realloc(*datap, *sizep += 4096);
+	struct operation *ops = NULL, *new;
+	char *line, *next, *fields[6];
+	size_t nops = 0, size = 0, lineno = 0, nfields;
+	int failed = 0;
+
+	for (line = data; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno += 1;
+		for (nfields = 0; nfields < 6; nfields++) {
+			line = &line[strspn(line, " \t")];
+			if (!*line || *line == '#')
+				break;
+			fields[nfields] = line;
+			line = &line[strcspn(line, " \t")];
+			if (*line)
+				*line++ = '\0';
+		}
+		if (!nfields)
+			continue;
+
+		if (nops == size) {
+			new = realloc(ops, (size = size ? size * 2 : 64) * sizeof(*ops));
 			if (!new) {
 				fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
 				exit(1);
 			}
-			*datap = new;
+			ops = new;
 		}
-		r = read(fd, &(*datap)[*lenp], *sizep - *lenp);
-		if (r < 0) {
-			fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
-			exit(1);
+		if (!strcmp(fields[0], "remove") ? nfields != 3 :
+		    (strcmp(fields[0], "add") && strcmp(fields[0], "replace")) || nfields < 4 || nfields > 5) {
+			fprintf(stderr, "%s: bad operation in %s on line %zu\n", argv0, path, lineno);
+			failed = 1;
+			continue;
 		}
-		*lenp += (size_t)r;
+		ops[nops].lineno = lineno;
+		ops[nops].user = fields[1];
+		ops[nops].keyname = fields[2];
+		ops[nops].keyfile = nfields > 3 ? fields[3] : NULL;
+		ops[nops].parameters = nfields > 4 ? fields[4] : NULL;
+		ops[nops].replace = !strcmp(fields[0], "replace");
+		if (fields[1][0] == '.' || strchr(fields[1], '/') || strchr(fields[1], '~')) {
+			fprintf(stderr, "%s: bad user name in %s on line %zu: %s\n", argv0, path, lineno, fields[1]);
+			failed = 1;
+		}
+		if (fields[2][strcspn(fields[2], " \t\f\n\r\v")]) {
+			fprintf(stderr, "%s: bad key name in %s on line %zu: %s, includes whitespace\n",
+			        argv0, path, lineno, fields[2]);
+			failed = 1;
+		}
+		nops++;
+	}
 
-		while (rhead2 < *lenp) {
-			if (!checkkey(*datap, *lenp, &rhead, &rhead2, &lineno, keyname, klen, path))
-				continue;
-			*beginning_out = rhead;
-			*end_out = rhead = rhead2;
+	if (failed)
+		exit(1);
+	*opsp = ops;
+	return nops;
+}
+
+
+static int
+manifest(const char *path)
+{
+	struct key2root_file file;
+	struct operation *ops, **byfile = NULL;
+	struct keyhash *keys = NULL;
+	struct target *targets = NULL;
+	struct key2root_change *changes = NULL;
+	size_t nops, nkeys = 0, ntargets = 0, i, j, workers, added, replaced, removed;
+	size_t *costs = NULL;
+	uint_least32_t m_cost, max_m_cost = 0;
+	long int nprocs;
+	const char *exceeded;
+	char *data;
+	int fd, failed = 0, committed = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, path, strerror(errno));
+		exit(1);
+	}
+	if (key2root_load_file(fd, &file) || close(fd)) {
+		fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
+		exit(1);
+	}
+	data = malloc(file.len + 1);
+	if (!data) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	if (memchr(file.data, '\0', file.len)) {
+		fprintf(stderr, "%s: NUL byte found in %s\n", argv0, path);
+		exit(1);
+	}
+	memcpy(data, file.data, file.len);
+	data[file.len] = '\0';
+	key2root_unload_file(&file);
+
+	nops = parsemanifest(data, path, &ops);
+	for (i = 0; i < nops; i++) {
+		if (ops[i].keyfile && (exceeded = exceeds(ops[i].parameters))) {
+			fprintf(stderr, "%s: parameters in %s on line %zu exceed %s in %s\n",
+			        argv0, path, ops[i].lineno, exceeded, CONFPATH);
+			failed = 1;
 		}
 	}
+	if (failed)
+		exit(1);
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = nprocs > 0 ? (size_t)nprocs : 1;
+
+	/* each distinct keyfile is hashed once, and the key hash is shared by all users it is added to */
+	byfile = calloc(nops + 1, sizeof(*byfile));
+	keys = calloc(nops + 1, sizeof(*keys));
+	costs = calloc(nops + 1, sizeof(*costs));
+	targets = calloc(nops + 1, sizeof(*targets));
+	changes = calloc(nops + 1, sizeof(*changes));
+	if (!byfile || !keys || !costs || !targets || !changes) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	for (i = j = 0; i < nops; i++)
+		if (ops[i].keyfile)
+			byfile[j++] = &ops[i];
+	qsort(byfile, j, sizeof(*byfile), cmpbykey);
+	for (i = 0; i < j; i++) {
+		if (!i || cmpbykey(&byfile[i - 1], &byfile[i])) {
+			keys[nkeys].keyfile = byfile[i]->keyfile;
+			keys[nkeys].parameters = byfile[i]->parameters;
+			if (!key2root_crypt_cost(byfile[i]->parameters ? byfile[i]->parameters
+			                         : libar2simplified_recommendation(0), &m_cost, NULL, NULL)) {
+				costs[nkeys] = (size_t)m_cost;
+				if (m_cost > max_m_cost)
+					max_m_cost = m_cost;
+			}
+			nkeys++;
+		}
+		byfile[i]->key = nkeys - 1;
+	}
+	key2root_crypt_reserve(max_m_cost);
+	if (key2root_run_jobs(nkeys, workers, key2root_tune_default_budget(), costs, hashkey, keys) < nkeys)
+		exit(1);
+	key2root_crypt_release();
+
+	/* each user's key file is rewritten once, with all of its changes */
+	qsort(ops, nops, sizeof(*ops), cmpbyuser);
+	for (i = 0; i < nops; i++) {
+		if (!i || strcmp(ops[i - 1].user, ops[i].user)) {
+			targets[ntargets].edit.user = ops[i].user;
+			targets[ntargets].edit.changes = &changes[i];
+			targets[ntargets].lineno = ops[i].lineno;
+			ntargets++;
+		} else if (!strcmp(ops[i - 1].keyname, ops[i].keyname)) {
+			fprintf(stderr, "%s: key %s for %s listed more than once in %s, on line %zu\n",
+			        argv0, ops[i].keyname, ops[i].user, path, ops[i].lineno);
+			failed = 1;
+		}
+		changes[i].keyname = ops[i].keyname;
+		changes[i].hash = ops[i].keyfile ? keys[ops[i].key].hash : NULL;
+		changes[i].force = ops[i].replace;
+		targets[ntargets - 1].edit.nchanges++;
+		if (targets[ntargets - 1].lineno > ops[i].lineno)
+			targets[ntargets - 1].lineno = ops[i].lineno;
+	}
+	if (failed)
+		exit(1);
 
-	if (rhead != *lenp) {
-		fprintf(stderr, "%s: file truncated: %s\n", argv0, path);
-		if (memchr(&(*datap)[rhead], '\0', *lenp - rhead))
-			fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, lineno + 1);
+	/* the users are locked in name order, so that two manifests cannot deadlock */
+	for (i = 0; i < ntargets; i++) {
+		targets[i].lock = key2root_lock(targets[i].edit.user);
+		if (targets[i].lock < 0)
+			exit(1);
+	}
+
+	/* no key file is changed unless all of them can be */
+	key2root_run_jobs(ntargets, workers, 0, NULL, preparetarget, targets);
+	qsort(targets, ntargets, sizeof(*targets), cmpbyline);
+	for (i = 0; i < ntargets; i++)
+		failed |= targets[i].failed;
+	if (!failed) {
+		committed = 1;
+		key2root_run_jobs(ntargets, workers, 0, NULL, committarget, targets);
+		for (i = 0; i < ntargets; i++)
+			failed |= targets[i].failed;
+		if (key2root_sync())
+			failed = 1;
+	}
+	for (i = 0; i < ntargets; i++)
+		key2root_unlock(targets[i].lock);
+
+	for (i = 0; i < ntargets; i++) {
+		if (committed && !targets[i].failed) {
+			if (key2root_cache_invalidate_user(targets[i].edit.user))
+				fprintf(stderr, "%s: invalidate credential cache for %s: %s\n",
+				        argv0, targets[i].edit.user, strerror(errno));
+			added = replaced = removed = 0;
+			for (j = 0; j < targets[i].edit.nchanges; j++) {
+				if (!targets[i].edit.changes[j].hash)
+					removed += 1;
+				else if (targets[i].edit.changes[j].found)
+					replaced += 1;
+				else
+					added += 1;
+			}
+			printf("%s: %zu added, %zu replaced, %zu removed\n", targets[i].edit.user, added, replaced, removed);
+		} else {
+			printf("%s: %s\n", targets[i].edit.user, targets[i].failed ? "failed" : "not changed");
+		}
+		key2root_discard(&targets[i].edit);
 	}
+
+	for (i = 0; i < nkeys; i++)
+		free(keys[i].hash);
+	free(keys);
+	free(byfile);
+	free(costs);
+	free(targets);
+	free(changes);
+	free(ops);
+	free(data);
+
+	if (fflush(stdout) || ferror(stdout) || fclose(stdout)) {
+		fprintf(stderr, "%s: printf: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	return failed;
 }
 
 
@@ -124,37 +392,68 @@ main(int argc, char *argv[])
 	const char *user;
 	const char *keyname;
 	const char *parameters;
-	char *path, *path2;
-	char *data = NULL;
-	size_t data_len = 0;
-	size_t data_size = 0;
-	size_t beginning = 0;
-	size_t end = 0;
 	int allow_replace = 0;
 	int add_hash = 0;
+	int prehash = 0;
 	int failed = 0;
-	int fd;
-	char *key = NULL, *new;
-	size_t key_len = 0;
-	size_t key_size = 0;
-	char *hash;
-	size_t gap_size;
-	size_t gap_increase;
-	ssize_t r;
+	struct key2root_key input;
+	struct key2root_change change;
+	unsigned char digest[KEY2ROOT_PREHASH_SIZE];
+	char *hash, *prehash_parameters, *tuned = NULL, *arg_end;
+	const char *exceeded;
+	unsigned long int milliseconds = 0;
+	uint_least32_t max_memory = 0, lanes = 0;
+	const char *arg, *manifest_path = NULL;
 	size_t i;
 
 	ARGBEGIN {
+	case 'f':
+		manifest_path = EARGF(usage());
+		break;
 	case 'h':
 		add_hash = 1;
 		break;
 	case 'r':
 		allow_replace = 1;
 		break;
+	case 's':
+		prehash = 1;
+		break;
+	case 't':
+		arg = EARGF(usage());
+		errno = 0;
+		milliseconds = strtoul(arg, &arg_end, 10);
+		if (errno || *arg_end || !isdigit((unsigned char)*arg) || !milliseconds)
+			usage();
+		break;
+	case 'm':
+		if (key2root_parse_memory(EARGF(usage()), &max_memory) || !max_memory)
+			usage();
+		break;
+	case 'p':
+		arg = EARGF(usage());
+		errno = 0;
+		lanes = (uint_least32_t)strtoul(arg, &arg_end, 10);
+		if (errno || *arg_end || !isdigit((unsigned char)*arg) || !lanes)
+			usage();
+		break;
 	default:
 		usage();
 	} ARGEND;
 
-	if (argc < 2 || argc > 3)
+	/* keys that key2root would refuse to check are not added */
+	if (key2root_load_config(&conf))
+		exit(1);
+
+	if (manifest_path) {
+		if (argc || add_hash || allow_replace || prehash || milliseconds || max_memory || lanes)
+			usage();
+		return manifest(manifest_path);
+	}
+
+	if (argc < 2 || argc > 3 || (add_hash && (prehash || milliseconds)))
+		usage();
+	if ((milliseconds && argc > 2) || (!milliseconds && (max_memory || lanes)))
 		usage();
 
 	user = argv[0];
@@ -183,134 +482,77 @@ main(int argc, char *argv[])
 				exit(1);
 			}
 		}
-		key_size = key_len = strlen(keyname) + strlen(parameters) + 2;
-		key = malloc(key_len + 1);
-		if (!key) {
-			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exceeded = exceeds(parameters);
+		if (exceeded) {
+			fprintf(stderr, "%s: key-hash exceeds %s in %s\n", argv0, exceeded, CONFPATH);
+			exit(1);
+		}
+		hash = strdup(parameters);
+		if (!hash) {
+			fprintf(stderr, "%s: strdup: %s\n", argv0, strerror(errno));
 			exit(1);
 		}
-		stpcpy(stpcpy(stpcpy(stpcpy(key, keyname), " "), parameters), "\n");
 	} else {
-		for (;;) {
-			if (key_len == key_size) {
-				new = malloc(1 + (key_size += 1024));
-				if (!new) {
-					explicit_bzero(key, key_len);
-					fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
-					exit(1);
-				}
-				memcpy(new, key, key_len);
-				explicit_bzero(key, key_len);
-				free(key);
-				key = new;
+		if (milliseconds) {
+			/* by default, the tuned parameters stay within the limits */
+			if (!max_memory) {
+				max_memory = key2root_tune_default_memory();
+				if (conf.max_memory && max_memory > conf.max_memory)
+					max_memory = conf.max_memory;
 			}
-			r = read(STDIN_FILENO, &key[key_len], key_size - key_len);
-			if (r <= 0) {
-				if (!r)
-					break;
-				explicit_bzero(key, key_len);
-				fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
-				exit(1);
+			if (!lanes) {
+				lanes = key2root_tune_default_lanes();
+				if (conf.max_lanes && lanes > conf.max_lanes)
+					lanes = conf.max_lanes;
 			}
-			key_len += (size_t)r;
-		}
-		hash = key2root_crypt(key, key_len, parameters, 1);
-		if (!hash)
-			exit(1);
-		free(key);
-		key_size = key_len = strlen(keyname) + strlen(hash) + 2;
-		key = malloc(key_len + 1);
-		if (!key) {
-			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
-			exit(1);
-		}
-		stpcpy(stpcpy(stpcpy(stpcpy(key, keyname), " "), hash), "\n");
-		free(hash);
-	}
-
-	path = malloc(sizeof(KEYPATH"/") + strlen(user));
-	if (!path) {
-		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
-		exit(1);
-	}
-	path2 = malloc(sizeof(KEYPATH"/~") + strlen(user));
-	if (!path) {
-		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
-		exit(1);
-	}
-	stpcpy(stpcpy(path, KEYPATH"/"), user);
-	stpcpy(stpcpy(path2, path), "~");
-
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		if (errno != ENOENT) {
-			fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, path, strerror(errno));
-			exit(1);
+			tuned = key2root_tune(milliseconds, max_memory, lanes);
+			if (!tuned)
+				exit(1);
+			parameters = tuned;
 		}
-		beginning = end = 0;
-	} else {
-		loadandlocate(&beginning, &end, fd, &data, &data_len, &data_size, keyname, path);
-		if (close(fd)) {
-			fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
+		exceeded = exceeds(parameters);
+		if (exceeded) {
+			fprintf(stderr, "%s: %s exceed %s in %s\n", argv0,
+			        milliseconds ? "tuned parameters" : parameters ? "crypt-parameters" : "default parameters",
+			        exceeded, CONFPATH);
 			exit(1);
 		}
-		if (beginning == end)
-			beginning = end = 0; /* make sure the new key is not concatenated onto a truncated line at the end */
-	}
-	if (!allow_replace && beginning != end) {
-		fprintf(stderr, "%s: key already exists: %s\n", argv0, keyname);
-		exit(1);
-	}
-	if (end < beginning)
-		abort();
-	gap_size = end - beginning;
-	if (gap_size > key_len) {
-		memmove(&data[beginning + key_len], &data[end], data_len - end);
-		data_len -= gap_size - key_len;
-	} else if (gap_size < key_len) {
-		gap_increase = key_len - gap_size;
-		if (data_len + gap_increase > data_size) {
-			data_size = data_len + gap_increase;
-			data = realloc(data, data_size);
-			if (!data) {
-				fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+		if (prehash || (parameters && key2root_prehashed(parameters))) {
+			prehash_parameters = key2root_prehash_parameters(parameters);
+			if (!prehash_parameters) {
+				fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+				exit(1);
+			}
+			if (key2root_prehash_fd(digest, STDIN_FILENO)) {
+				fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
 				exit(1);
 			}
+			hash = key2root_crypt((char *)digest, sizeof(digest), prehash_parameters, 1);
+			free(prehash_parameters);
+		} else {
+			if (key2root_read_key(STDIN_FILENO, &input, 1)) {
+				fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
+				exit(1);
+			}
+			hash = key2root_crypt(input.data, input.len, parameters, !input.from_file);
+			key2root_free_key(&input);
 		}
-		memmove(&data[end + gap_increase], &data[end], data_len - end);
-		data_len += gap_increase;
+		key2root_crypt_release();
+		if (!hash)
+			exit(1);
+		free(tuned);
 	}
-	memcpy(&data[beginning], key, key_len);
-	free(key);
 
-	if (mkdir(KEYPATH, 0700) && errno != EEXIST) {
-		fprintf(stderr, "%s: mkdir %s: %s\n", argv0, KEYPATH, strerror(errno));
+	change.keyname = keyname;
+	change.hash = hash;
+	change.expect = NULL;
+	change.force = allow_replace;
+	if (key2root_submit(user, &change, 1))
 		exit(1);
-	}
-	fd = open(path2, O_WRONLY | O_CREAT | O_EXCL, 0600);
-	if (fd < 0) {
-		fprintf(stderr, "%s: open %s O_WRONLY|O_CREAT|O_EXCL 0600: %s\n", argv0, path2, strerror(errno));
-		exit(1);
-	}
-	if (writeall(fd, data, data_len)) {
-		fprintf(stderr, "%s: write %s: %s\n", argv0, path2, strerror(errno));
-		close(fd);
-		goto saved_failed;
-	}
-	if (close(fd)) {
-		fprintf(stderr, "%s: write %s: %s\n", argv0, path2, strerror(errno));
-		goto saved_failed;
-	}
-	if (rename(path2, path)) {
-		fprintf(stderr, "%s: rename %s %s: %s\n", argv0, path2, path, strerror(errno));
-	saved_failed:
-		if (unlink(path2))
-			fprintf(stderr, "%s: unlink %s: %s\n", argv0, path2, strerror(errno));
-		exit(1);
-	}
+	if (key2root_cache_invalidate_user(user))
+		fprintf(stderr, "%s: invalidate credential cache for %s: %s\n", argv0, user, strerror(errno));
 
-	free(path);
-	free(path2);
-	free(data);
+	free(hash);
+	key2root_free_config(&conf);
 	return 0;
 }
@@ -0,0 +1,129 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arg.h"
+#include "keydb.h"
+#include "mapfile.h"
+#include "edit.h"
+
+
+char *argv0;
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [user] ...\n", argv0);
+	exit(1);
+}
+
+
+static int
+compile(const char *user)
+{
+	char *path;
+	int failed = 0, lock;
+
+	path = malloc(sizeof(KEYPATH"/") + strlen(user));
+	if (!path) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	stpcpy(stpcpy(path, KEYPATH"/"), user);
+
+	/* the database is written under the same lock as the key file */
+	lock = key2root_lock(user);
+	if (lock < 0) {
+		free(path);
+		return 1;
+	}
+	if (key2root_recompile_keydb(path)) {
+		fprintf(stderr, "%s: compile %s%s: %s\n", argv0, path, KEY2ROOT_KEYDB_SUFFIX, strerror(errno));
+		failed = 1;
+	}
+	key2root_unlock(lock);
+
+	free(path);
+	return failed;
+}
+
+
+static int
+orphaned(int dir, const char *name)
+{
+	size_t len = strlen(name), suffix_len = sizeof(KEY2ROOT_KEYDB_SUFFIX) - 1;
+	char *user;
+	struct stat st;
+	int ret;
+
+	if (len <= suffix_len || strcmp(&name[len - suffix_len], KEY2ROOT_KEYDB_SUFFIX))
+		return 0;
+	user = strndup(name, len - suffix_len);
+	if (!user) {
+		fprintf(stderr, "%s: strndup: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	ret = strchr(user, '~') == NULL && fstatat(dir, user, &st, 0) && errno == ENOENT;
+	free(user);
+	return ret;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	int failed = 0, fd;
+	DIR *dir;
+	struct dirent *f;
+
+	ARGBEGIN {
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc) {
+		for (; *argv; argv++) {
+			if (!(*argv)[0] || (*argv)[0] == '.' || strchr(*argv, '/') || strchr(*argv, '~')) {
+				fprintf(stderr, "%s: bad user name specified: %s\n", argv0, *argv);
+				failed = 1;
+			} else {
+				failed |= compile(*argv);
+			}
+		}
+	} else {
+		dir = opendir(KEYPATH"/");
+		if (!dir) {
+			if (errno == ENOENT)
+				return 0;
+			fprintf(stderr, "%s: opendir %s/: %s\n", argv0, KEYPATH, strerror(errno));
+			exit(1);
+		}
+		fd = dirfd(dir);
+		if (fd < 0)
+			abort();
+		while ((errno = 0, f = readdir(dir))) {
+			if (f->d_name[0] == '.')
+				continue;
+			if (!strchr(f->d_name, '~')) {
+				failed |= compile(f->d_name);
+			} else if (orphaned(fd, f->d_name)) {
+				if (unlinkat(fd, f->d_name, 0)) {
+					fprintf(stderr, "%s: unlinkat %s/ %s: %s\n", argv0, KEYPATH, f->d_name, strerror(errno));
+					failed = 1;
+				}
+			}
+		}
+		if (errno || closedir(dir)) {
+			fprintf(stderr, "%s: readdir %s/: %s\n", argv0, KEYPATH, strerror(errno));
+			exit(1);
+		}
+	}
+
+	return failed;
+}
@@ -1,78 +1,401 @@
 /* See LICENSE file for copyright and license details. */
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <libar2simplified.h>
 
 #include "arg.h"
 #include "crypt.h"
+#include "jobs.h"
+#include "readkey.h"
+#include "trace.h"
+#include "tune.h"
 
 
 char *argv0;
 
 
+struct record {
+	char *key;
+	size_t key_len;
+	char *stored;
+	char *hash;
+	int verified; /* 1 on match, 0 on mismatch, -1 on error */
+	int done;
+};
+
+struct batch {
+	pthread_mutex_t mutex;
+	struct record *records;
+	size_t nrecords;
+	size_t next_output;
+	const char *parameters;
+	int autoerase;
+	int verify;
+	int mismatch;
+	int invalid;
+	int failed;
+};
+
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [crypt-parameters]\n", argv0);
+	fprintf(stderr, "usage: %s [-sv] [crypt-parameters | -t milliseconds [-m max-memory] [-p lanes]]\n"
+	                "       %s (-0 | -n) [-sv] [-j workers] [-m max-memory] [crypt-parameters]\n"
+	                "       %s (-0 | -n) -c [-v] [-j workers] [-m max-memory]\n", argv0, argv0, argv0);
 	exit(1);
 }
 
 
+static int
+nextrecord(char *data, size_t len, size_t *offp, int netstrings, char **recordp, size_t *record_lenp)
+{
+	char *nul;
+	size_t n = 0, off = *offp;
+
+	if (off == len)
+		return 0;
+
+	if (!netstrings) {
+		/* the last record does not need to be terminated */
+		nul = memchr(&data[off], '\0', len - off);
+		*recordp = &data[off];
+		*record_lenp = (nul ? (size_t)(nul - data) : len) - off;
+		*offp = nul ? (size_t)(nul - data) + 1 : len;
+		return 1;
+	}
+
+	if (!isdigit((unsigned char)data[off]) || (data[off] == '0' && off + 1 < len && data[off + 1] != ':'))
+		return -1;
+	for (; off < len && isdigit((unsigned char)data[off]); off++) {
+		if (n > (SIZE_MAX - 9) / 10)
+			return -1;
+		n = n * 10 + (size_t)(data[off] & 15);
+	}
+	if (off == len || data[off++] != ':' || n >= len - off || data[off + n] != ',')
+		return -1;
+	*recordp = &data[off];
+	*record_lenp = n;
+	*offp = off + n + 1;
+	return 1;
+}
+
+
+static void
+output(struct batch *batch)
+{
+	struct record *record;
+
+	/* results are printed in input order, as soon as all earlier results are available */
+	for (; batch->next_output < batch->nrecords && !batch->failed; batch->next_output++) {
+		record = &batch->records[batch->next_output];
+		if (!record->done)
+			break;
+		if (batch->verify) {
+			printf("%s\n", record->verified < 0 ? "error" : record->verified ? "match" : "mismatch");
+			if (record->verified < 0)
+				batch->invalid = 1;
+			else if (!record->verified)
+				batch->mismatch = 1;
+		} else if (record->hash) {
+			printf("%s\n", record->hash);
+		} else {
+			batch->failed = 1;
+		}
+		free(record->hash);
+		record->hash = NULL;
+	}
+}
+
+
+static int
+hashrecord(size_t i, void *user)
+{
+	struct batch *batch = user;
+	struct record *record = &batch->records[i];
+	struct key2root_trace trace;
+	unsigned char digest[KEY2ROOT_PREHASH_SIZE];
+	const char *parameters = batch->verify ? record->stored : batch->parameters;
+	char *msg = record->key, *hash = NULL;
+	size_t msg_len = record->key_len;
+	int autoerase = batch->autoerase, failed, verified = 0;
+
+	key2root_trace_start(&trace);
+	if (parameters && key2root_prehashed(parameters)) {
+		key2root_prehash(digest, msg, msg_len);
+		if (autoerase)
+			key2root_erase(msg, msg_len);
+		msg = (char *)digest;
+		msg_len = sizeof(digest);
+		autoerase = 1;
+	}
+	if (batch->verify) {
+		/* the digest is compared directly, rather than encoding the hash */
+		verified = key2root_verify(msg, msg_len, parameters, strlen(parameters), autoerase);
+		key2root_trace_stop(&trace, "verify record %zu %.*s", i + 1,
+		                    key2root_trace_parameters(parameters, strlen(parameters)), parameters);
+	} else {
+		hash = key2root_crypt(msg, msg_len, parameters, autoerase);
+		if (hash)
+			key2root_trace_stop(&trace, "hash record %zu %.*s", i + 1,
+			                    key2root_trace_parameters(hash, strlen(hash)), hash);
+	}
+
+	pthread_mutex_lock(&batch->mutex);
+	record->hash = hash;
+	record->verified = verified;
+	record->done = 1;
+	output(batch);
+	failed = batch->failed;
+	pthread_mutex_unlock(&batch->mutex);
+
+	return failed;
+}
+
+
+static int
+batch(const char *parameters, int netstrings, int verify, size_t workers, uint_least32_t max_memory)
+{
+	struct batch batch;
+	struct key2root_key input;
+	struct key2root_trace trace;
+	struct record *new;
+	size_t *costs = NULL, size = 0, off = 0, i, key_len, len;
+	uint_least32_t m_cost, max_m_cost = 0;
+	char *key, *record;
+	int r;
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.mutex, NULL);
+	batch.parameters = parameters;
+	batch.verify = verify;
+
+	key2root_trace_start(&trace);
+	if (key2root_read_key(STDIN_FILENO, &input, 1)) {
+		fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	batch.autoerase = !input.from_file;
+
+	while ((r = nextrecord(input.data, input.len, &off, netstrings, &key, &key_len)) > 0) {
+		if (verify) {
+			r = nextrecord(input.data, input.len, &off, netstrings, &record, &len);
+			if (r < 0)
+				break;
+			if (!r) {
+				fprintf(stderr, "%s: key without key hash in record %zu on <stdin>\n", argv0, batch.nrecords * 2 + 1);
+				exit(1);
+			}
+		}
+		if (batch.nrecords == size) {
+			size = size ? size * 2 : 64;
+			new = realloc(batch.records, size * sizeof(*batch.records));
+			if (!new) {
+				fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+				exit(1);
+			}
+			batch.records = new;
+		}
+		memset(&batch.records[batch.nrecords], 0, sizeof(*batch.records));
+		batch.records[batch.nrecords].key = key;
+		batch.records[batch.nrecords].key_len = key_len;
+		if (verify) {
+			batch.records[batch.nrecords].stored = strndup(record, len);
+			if (!batch.records[batch.nrecords].stored) {
+				fprintf(stderr, "%s: strndup: %s\n", argv0, strerror(errno));
+				exit(1);
+			}
+		}
+		batch.nrecords++;
+	}
+	if (r < 0) {
+		fprintf(stderr, "%s: malformed netstring at byte %zu on <stdin>\n", argv0, off);
+		exit(1);
+	}
+	key2root_trace_stop(&trace, "read %zu records, %zu bytes, from <stdin> (%s)", batch.nrecords,
+	                    input.len, input.from_file ? "mapped" : "copied");
+
+	/* the memory budget is in kibibytes, like the memory cost */
+	costs = calloc(batch.nrecords ? batch.nrecords : 1, sizeof(*costs));
+	if (!costs) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	if (!parameters)
+		parameters = libar2simplified_recommendation(0);
+	for (i = 0; i < batch.nrecords; i++) {
+		if (key2root_crypt_cost(verify ? batch.records[i].stored : parameters, &m_cost, NULL, NULL))
+			continue;
+		costs[i] = (size_t)m_cost;
+		if (m_cost > max_m_cost)
+			max_m_cost = m_cost;
+	}
+
+	key2root_trace_start(&trace);
+	key2root_crypt_reserve(max_m_cost);
+	key2root_run_jobs(batch.nrecords, workers, max_memory, costs, hashrecord, &batch);
+	key2root_crypt_release();
+	key2root_trace_stop(&trace, "hash %zu records with up to %zu workers", batch.nrecords, workers);
+
+	for (i = 0; i < batch.nrecords; i++) {
+		free(batch.records[i].hash);
+		free(batch.records[i].stored);
+	}
+	free(batch.records);
+	free(costs);
+	key2root_free_key(&input);
+	pthread_mutex_destroy(&batch.mutex);
+
+	return (batch.failed || batch.invalid) ? 1 : batch.mismatch ? 2 : 0;
+}
+
+
 int
 main(int argc, char *argv[])
 {
 	const char *parameters;
-	char *key = NULL, *new;
-	size_t key_len = 0;
-	size_t key_size = 0;
-	char *hash;
-	ssize_t r;
+	struct key2root_key key;
+	unsigned char digest[KEY2ROOT_PREHASH_SIZE];
+	char *hash, *prehash_parameters = NULL, *tuned, *end;
+	int prehash = 0;
+	unsigned long int milliseconds = 0;
+	uint_least32_t max_memory = 0, lanes = 0;
+	const char *arg;
+	struct key2root_trace trace;
+	int netstrings = -1, verify = 0, ret = 0;
+	size_t workers = 0;
+	long int nprocs;
 
 	ARGBEGIN {
+	case '0':
+		if (netstrings > 0)
+			usage();
+		netstrings = 0;
+		break;
+	case 'n':
+		if (!netstrings)
+			usage();
+		netstrings = 1;
+		break;
+	case 'c':
+		verify = 1;
+		break;
+	case 'j':
+		arg = EARGF(usage());
+		errno = 0;
+		workers = (size_t)strtoul(arg, &end, 10);
+		if (errno || *end || !isdigit((unsigned char)*arg) || !workers)
+			usage();
+		break;
+	case 's':
+		prehash = 1;
+		break;
+	case 't':
+		arg = EARGF(usage());
+		errno = 0;
+		milliseconds = strtoul(arg, &end, 10);
+		if (errno || *end || !isdigit((unsigned char)*arg) || !milliseconds)
+			usage();
+		break;
+	case 'm':
+		if (key2root_parse_memory(EARGF(usage()), &max_memory) || !max_memory)
+			usage();
+		break;
+	case 'p':
+		arg = EARGF(usage());
+		errno = 0;
+		lanes = (uint_least32_t)strtoul(arg, &end, 10);
+		if (errno || *end || !isdigit((unsigned char)*arg) || !lanes)
+			usage();
+		break;
+	case 'v':
+		key2root_tracing = 1;
+		break;
 	default:
 		usage();
 	} ARGEND;
 
-	if (argc > 1)
+	if (argc > 1 || (milliseconds && argc))
+		usage();
+	if (netstrings < 0 ? verify || workers || (!milliseconds && (max_memory || lanes))
+	                   : milliseconds || lanes || (verify && (prehash || argc)))
 		usage();
 
 	parameters = argv[0];
+	key2root_trace_note("argon2 kernel: %s", key2root_crypt_kernel());
 
-	for (;;) {
-		if (key_len == key_size) {
-			new = malloc(1 + (key_size += 1024));
-			if (!new) {
-				explicit_bzero(key, key_len);
-				fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
+	if (netstrings >= 0) {
+		if (prehash) {
+			prehash_parameters = key2root_prehash_parameters(parameters);
+			if (!prehash_parameters) {
+				fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
 				exit(1);
 			}
-			memcpy(new, key, key_len);
-			explicit_bzero(key, key_len);
-			free(key);
-			key = new;
+			parameters = prehash_parameters;
 		}
-		r = read(STDIN_FILENO, &key[key_len], key_size - key_len);
-		if (r <= 0) {
-			if (!r)
-				break;
-			explicit_bzero(key, key_len);
+		if (!workers) {
+			nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+			workers = nprocs > 0 ? (size_t)nprocs : 1;
+		}
+		ret = batch(parameters, netstrings, verify, workers, max_memory ? max_memory : key2root_tune_default_budget());
+		free(prehash_parameters);
+		goto out;
+	}
+
+	if (milliseconds) {
+		key2root_trace_start(&trace);
+		tuned = key2root_tune(milliseconds, max_memory ? max_memory : key2root_tune_default_memory(),
+		                      lanes ? lanes : key2root_tune_default_lanes());
+		if (!tuned)
+			exit(1);
+		key2root_trace_stop(&trace, "tune %s", tuned);
+		printf("%s%s\n", prehash ? KEY2ROOT_PREHASH_PREFIX : "", tuned);
+		free(tuned);
+		goto out;
+	}
+
+	if (prehash || (parameters && key2root_prehashed(parameters))) {
+		prehash_parameters = key2root_prehash_parameters(parameters);
+		if (!prehash_parameters) {
+			fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		key2root_trace_start(&trace);
+		if (key2root_prehash_fd(digest, STDIN_FILENO)) {
+			fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		key2root_trace_stop(&trace, "prehash <stdin>");
+		key2root_trace_start(&trace);
+		hash = key2root_crypt((char *)digest, sizeof(digest), prehash_parameters, 1);
+		free(prehash_parameters);
+	} else {
+		key2root_trace_start(&trace);
+		if (key2root_read_key(STDIN_FILENO, &key, 1)) {
 			fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
 			exit(1);
 		}
-		key_len += (size_t)r;
+		key2root_trace_stop(&trace, "read %zu bytes from <stdin> (%s)", key.len, key.from_file ? "mapped" : "copied");
+		key2root_trace_start(&trace);
+		hash = key2root_crypt(key.data, key.len, parameters, !key.from_file);
+		key2root_free_key(&key);
 	}
-	hash = key2root_crypt(key, key_len, parameters, 1);
 	if (!hash)
 		exit(1);
-	free(key);
+	key2root_trace_stop(&trace, "hash %.*s", key2root_trace_parameters(hash, strlen(hash)), hash);
+	key2root_crypt_release();
 	printf("%s\n", hash);
 	free(hash);
 
+out:
 	if (fflush(stdout) || ferror(stdout) || fclose(stdout)) {
 		fprintf(stderr, "%s: printf: %s\n", argv0, strerror(errno));
 		exit(1);
 	}
-	return 0;
+	return ret;
 }
@@ -1,131 +1,562 @@
 /* See LICENSE file for copyright and license details. */
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "arg.h"
+#include "crypt.h"
+#include "jobs.h"
+#include "mapfile.h"
+#include "scan.h"
+#include "tune.h"
+
+#define DIRENTS_SIZE (1 << 20)
+#define OUTPUT_SIZE  (1 << 20)
+#define REPORT_SIZE  (8 * 3 * sizeof(uintmax_t)) /* room for the numbers on a line of a cost report */
 
 
 char *argv0;
 
+struct cost {
+	double ms; /* the estimated time to verify the key, or for the -u option, to fail authentication */
+	uint_least32_t m_cost;
+	uint_least32_t lanes;
+	const char *text; /* the output line, NULL if it is filtered out */
+	size_t len;
+	size_t order; /* the line's position in the output, if it were not sorted */
+};
+
+struct user {
+	const char *name;
+	char *out;
+	size_t out_len;
+	struct cost *costs;
+	size_t ncosts;
+	char *err;
+	size_t err_len;
+	FILE *errf;
+	int bad;
+	int failed;
+	int done;
+};
+
+struct scan {
+	pthread_mutex_t mutex;
+	int dir;
+	struct user *users;
+	size_t nusers;
+	size_t next_output;
+	char *buf;
+	size_t len;
+	int failed;
+	int print_failed;
+	int report;
+	int totals;
+	int sorted;
+	double min_ms;
+	size_t max_threads;
+	struct key2root_calibration calibration;
+	size_t norder;
+};
+
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [user] ...\n", argv0);
+	fprintf(stderr, "usage: %s [-csu] [-j max-threads] [-t milliseconds] [user] ...\n", argv0);
 	exit(1);
 }
 
 
-static int
-outputkey(char *data, size_t whead, size_t *rheadp, size_t *rhead2p, size_t *linenop, const char *user)
+static void
+complain(struct user *user, const char *fmt, ...)
 {
-	int failed = 0;
-	size_t len;
+	va_list args;
+
+	if (!user->errf) {
+		user->errf = open_memstream(&user->err, &user->err_len);
+		if (!user->errf) {
+			fprintf(stderr, "%s: open_memstream: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+	}
+	va_start(args, fmt);
+	vfprintf(user->errf, fmt, args);
+	va_end(args);
+	user->failed = 1;
+}
+
+
+static void
+reportkey(struct scan *scan, const struct key2root_line *line, struct user *user)
+{
+	struct cost *cost = &user->costs[user->ncosts];
+	size_t keyname_len = (size_t)(line->sp - line->data);
+	uint_least32_t t_cost;
+	char *hash, *text;
+	int r;
+
+	hash = strndup(&line->sp[1], line->len - keyname_len - 1);
+	if (!hash) {
+		complain(user, "%s: strndup: %s\n", argv0, strerror(errno));
+		return;
+	}
+	r = key2root_crypt_cost(hash, &cost->m_cost, &t_cost, &cost->lanes);
+	free(hash);
+	if (r || !cost->lanes) {
+		complain(user, "%s: invalid key hash in %s/%s on line %zu\n", argv0, KEYPATH, user->name, line->lineno);
+		return;
+	}
+	user->ncosts += 1;
+
+	cost->ms = key2root_estimate(&scan->calibration, cost->m_cost, t_cost, cost->lanes) * 1000;
+	cost->text = NULL;
+	if (scan->totals || cost->ms < scan->min_ms)
+		return;
+	text = &user->out[user->out_len];
+	cost->len = (size_t)sprintf(text, "%s %.*s %ju %ju %ju %.1f\n", user->name, (int)keyname_len, line->data,
+	                            (uintmax_t)cost->m_cost, (uintmax_t)t_cost, (uintmax_t)cost->lanes, cost->ms);
+	cost->text = text;
+	user->out_len += cost->len;
+}
+
+
+/* Estimates the time and memory that key2root, with the -j option, spends on
+ * the user's keys when none of them matches, by replaying the scheduling of
+ * key2root_run_jobs(): the keys are checked in order, with up to max_threads
+ * threads, where a key counts as one thread per lane */
+static void
+simulate(const struct cost *costs, size_t n, size_t max_threads, double *msp, uintmax_t *peakp)
+{
+	struct running { double end; size_t lanes; uint_least32_t m_cost; } *running;
+	size_t nrunning = 0, in_use = 0, lanes, i, j, first;
+	uintmax_t memory = 0, peak = 0;
+	double now = 0, end = 0;
+
+	running = calloc(n < max_threads ? n : max_threads, sizeof(*running));
+	if (!running) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		lanes = costs[i].lanes < max_threads ? (size_t)costs[i].lanes : max_threads;
+		while (nrunning == max_threads || (in_use && in_use + lanes > max_threads)) {
+			for (first = 0, j = 1; j < nrunning; j++)
+				if (running[j].end < running[first].end)
+					first = j;
+			now = running[first].end;
+			in_use -= running[first].lanes;
+			memory -= running[first].m_cost;
+			running[first] = running[--nrunning];
+		}
+		running[nrunning].end = now + costs[i].ms;
+		running[nrunning].lanes = lanes;
+		running[nrunning].m_cost = costs[i].m_cost;
+		if (running[nrunning].end > end)
+			end = running[nrunning].end;
+		nrunning += 1;
+		in_use += lanes;
+		memory += costs[i].m_cost;
+		if (memory > peak)
+			peak = memory;
+	}
+
+	free(running);
+	*msp = end;
+	*peakp = peak;
+}
+
+
+static void
+reportuser(struct scan *scan, struct user *user)
+{
+	struct cost *cost = &user->costs[0];
+	uintmax_t sequential_peak = 0, parallel_peak;
+	double sequential_ms = 0, parallel_ms;
+	size_t i;
 
-	while (*rhead2p < whead && data[*rhead2p] != '\n')
-		++*rhead2p;
+	if (!user->ncosts)
+		return;
+	for (i = 0; i < user->ncosts; i++) {
+		sequential_ms += user->costs[i].ms;
+		if (user->costs[i].m_cost > sequential_peak)
+			sequential_peak = user->costs[i].m_cost;
+	}
+	simulate(user->costs, user->ncosts, scan->max_threads, &parallel_ms, &parallel_peak);
 
-	if (data[*rhead2p] != '\n')
-		return 0;
+	/* the entries are replaced with the user's totals */
+	cost->ms = sequential_ms;
+	cost->text = NULL;
+	if (sequential_ms >= scan->min_ms) {
+		cost->text = user->out;
+		user->out_len = (size_t)sprintf(user->out, "%s %zu %.1f %ju %.1f %ju\n", user->name, user->ncosts,
+		                                sequential_ms, sequential_peak, parallel_ms, parallel_peak);
+		cost->len = user->out_len;
+	}
+	user->ncosts = 1;
+}
 
-	len = *rhead2p - *rheadp;
-	*linenop += 1;
 
-	if (memchr(&data[*rheadp], '\0', len)) {
-		fprintf(stderr, "%s: NUL byte found in %s/%s on line %zu\n", argv0, KEYPATH, user, *linenop);
+static void
+outputkey(struct scan *scan, const struct key2root_line *line, struct user *user, size_t name_len)
+{
+	int failed = 0;
+
+	if (line->has_nul) {
+		complain(user, "%s: NUL byte found in %s/%s on line %zu\n", argv0, KEYPATH, user->name, line->lineno);
 		failed = 1;
 	}
-	if (!memchr(&data[*rheadp], ' ', len)) {
-		fprintf(stderr, "%s: no SP byte found in %s/%s on line %zu\n", argv0, KEYPATH, user, *linenop);
+	if (!line->sp) {
+		complain(user, "%s: no SP byte found in %s/%s on line %zu\n", argv0, KEYPATH, user->name, line->lineno);
 		failed = 1;
 	}
 
-	if (!failed) {
-		data[*rhead2p] = '\0';
-		printf("%s %s\n", user, &data[*rheadp]);
+	if (!failed && scan->report) {
+		reportkey(scan, line, user);
+	} else if (!failed) {
+		memcpy(&user->out[user->out_len], user->name, name_len);
+		user->out_len += name_len;
+		user->out[user->out_len++] = ' ';
+		memcpy(&user->out[user->out_len], line->data, line->len + 1);
+		user->out_len += line->len + 1;
+	}
+}
+
+
+static void
+listkeys(struct scan *scan, struct user *user)
+{
+	int fd;
+	struct key2root_file file;
+	struct key2root_scanner scanner;
+	struct key2root_line line;
+	size_t nlines = 0;
+	size_t name_len;
+	const char *p;
+
+	fd = openat(scan->dir, user->name, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			complain(user, "%s: openat %s/ %s O_RDONLY: %s\n", argv0, KEYPATH, user->name, strerror(errno));
+		return;
+	}
+	if (key2root_load_file(fd, &file)) {
+		complain(user, "%s: read %s/%s: %s\n", argv0, KEYPATH, user->name, strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	/* each output line is the input line prefixed with the user name and a space */
+	name_len = strlen(user->name);
+	for (p = file.data; (p = memchr(p, '\n', file.len - (size_t)(p - file.data))); p++)
+		nlines++;
+	/* with the -c option, the key hash is instead replaced with a few numbers */
+	if (scan->report) {
+		user->out = malloc(file.len + (nlines + 1) * (name_len + 1 + REPORT_SIZE) + 1);
+		user->costs = calloc(nlines + 1, sizeof(*user->costs));
+	} else {
+		user->out = malloc(file.len + nlines * (name_len + 1) + 1);
+	}
+	if (!user->out || (scan->report && !user->costs)) {
+		complain(user, "%s: malloc: %s\n", argv0, strerror(errno));
+		key2root_unload_file(&file);
+		return;
+	}
+
+	key2root_scan_init(&scanner, file.data, file.len);
+	while (key2root_scan_line(&scanner, &line))
+		outputkey(scan, &line, user, name_len);
+	if (scan->totals)
+		reportuser(scan, user);
+
+	if (scanner.pos != file.len) {
+		complain(user, "%s: file truncated: %s/%s\n", argv0, KEYPATH, user->name);
+		if (memchr(&file.data[scanner.pos], '\0', file.len - scanner.pos))
+			complain(user, "%s: NUL byte found in %s/%s on line %zu\n", argv0, KEYPATH, user->name, scanner.lineno + 1);
 	}
 
-	*rheadp = ++*rhead2p;
-	return failed;
+	key2root_unload_file(&file);
 }
 
 
 static int
-listkeys(int dir, const char *user)
-{
-	int fd, failed = 0;
-	char *data = NULL, *new;
-	size_t size = 0;
-	size_t whead = 0;
-	size_t rhead = 0;
-	size_t rhead2 = 0;
-	size_t lineno = 0;
-	ssize_t r = 1;
-
-	fd = openat(dir, user, O_RDONLY);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			return 0;
-		fprintf(stderr, "%s: openat %s/ %s O_RDONLY: %s\n", argv0, KEYPATH, user, strerror(errno));
-		return 1;
-	}
-
-	while (r) {
-		if (whead == size) {
-			memmove(data, &data[rhead], whead -= rhead);
-			rhead2 -= rhead;
-			rhead = 0;
-			if (whead == size) {
-				new = realloc(data, size += 1024);
+flushoutput(struct scan *scan)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < scan->len) {
+		r = write(STDOUT_FILENO, &scan->buf[off], scan->len - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: print: %s\n", argv0, strerror(errno));
+			scan->print_failed = 1;
+			return -1;
+		}
+		off += (size_t)r;
+	}
+	scan->len = 0;
+	return 0;
+}
+
+
+static void
+print(struct scan *scan, const char *text, size_t len)
+{
+	size_t n, off;
+
+	for (off = 0; off < len && !scan->print_failed; off += n) {
+		n = len - off;
+		if (n > OUTPUT_SIZE - scan->len)
+			n = OUTPUT_SIZE - scan->len;
+		memcpy(&scan->buf[scan->len], &text[off], n);
+		scan->len += n;
+		if (scan->len == OUTPUT_SIZE)
+			flushoutput(scan);
+	}
+}
+
+
+static void
+output(struct scan *scan)
+{
+	struct user *user;
+	size_t i;
+
+	/* users are printed in order, as soon as all earlier users have been listed */
+	for (; scan->next_output < scan->nusers && !scan->print_failed; scan->next_output++) {
+		user = &scan->users[scan->next_output];
+		if (!user->done)
+			break;
+		if (user->bad)
+			fprintf(stderr, "%s: bad user name specified: %s\n", argv0, user->name);
+		if (user->errf) {
+			fclose(user->errf);
+			user->errf = NULL;
+			fwrite(user->err, 1, user->err_len, stderr);
+			free(user->err);
+		}
+		scan->failed |= user->failed;
+		/* with the -s option, the output is printed once all users have been listed */
+		if (scan->sorted) {
+			for (i = 0; i < user->ncosts; i++)
+				user->costs[i].order = scan->norder++;
+			continue;
+		}
+		print(scan, user->out, user->out_len);
+		free(user->out);
+		free(user->costs);
+		user->out = NULL;
+		user->costs = NULL;
+	}
+}
+
+
+static int
+costcmp(const void *a, const void *b)
+{
+	const struct cost *x = *(const struct cost *const *)a, *y = *(const struct cost *const *)b;
+
+	/* most expensive first, and otherwise in the order they would have been printed */
+	if (x->ms != y->ms)
+		return x->ms < y->ms ? 1 : -1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+
+static void
+outputsorted(struct scan *scan)
+{
+	const struct cost **costs;
+	size_t i, j, n = 0;
+
+	costs = calloc(scan->norder ? scan->norder : 1, sizeof(*costs));
+	if (!costs) {
+		fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < scan->nusers; i++)
+		for (j = 0; j < scan->users[i].ncosts; j++)
+			if (scan->users[i].costs[j].text)
+				costs[n++] = &scan->users[i].costs[j];
+	qsort(costs, n, sizeof(*costs), costcmp);
+
+	for (i = 0; i < n; i++)
+		print(scan, costs[i]->text, costs[i]->len);
+
+	for (i = 0; i < scan->nusers; i++) {
+		free(scan->users[i].out);
+		free(scan->users[i].costs);
+	}
+	free(costs);
+}
+
+
+static int
+listuser(size_t i, void *data)
+{
+	struct scan *scan = data;
+	struct user *user = &scan->users[i];
+	int stop;
+
+	if (!user->bad)
+		listkeys(scan, user);
+
+	pthread_mutex_lock(&scan->mutex);
+	user->done = 1;
+	output(scan);
+	stop = scan->print_failed;
+	pthread_mutex_unlock(&scan->mutex);
+
+	return stop;
+}
+
+
+static int
+usercmp(const void *a, const void *b)
+{
+	return strcmp(((const struct user *)a)->name, ((const struct user *)b)->name);
+}
+
+
+static int
+readusers(int dir, char **namesp, struct user **usersp, size_t *nusersp)
+{
+	char *dirents, *names = NULL, *new;
+	struct dirent64 *f;
+	struct user *users = NULL, *new_users;
+	size_t len = 0, size = 0, n = 0, users_size = 0, name_len, i;
+	ssize_t r, off;
+
+	/* the directory is read in large batches, rather than readdir(3)'s default size */
+	dirents = malloc(DIRENTS_SIZE);
+	if (!dirents) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return -1;
+	}
+	while ((r = getdents64(dir, dirents, DIRENTS_SIZE))) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: getdents64 %s/: %s\n", argv0, KEYPATH, strerror(errno));
+			goto fail;
+		}
+		for (off = 0; off < r; off += f->d_reclen) {
+			f = (void *)&dirents[off];
+			if (f->d_name[0] == '.' || strchr(f->d_name, '~'))
+				continue;
+			name_len = strlen(f->d_name) + 1;
+			if (len + name_len > size) {
+				size = (len + name_len) * 2;
+				new = realloc(names, size);
 				if (!new) {
 					fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
-					close(fd);
-					return 1;
+					goto fail;
 				}
-				data = new;
+				names = new;
 			}
+			if (n == users_size) {
+				users_size = users_size ? users_size * 2 : 64;
+				new_users = realloc(users, users_size * sizeof(*users));
+				if (!new_users) {
+					fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+					goto fail;
+				}
+				users = new_users;
+			}
+			memset(&users[n], 0, sizeof(*users));
+			/* an offset until all names have been read, as `names` may move */
+			users[n++].name = (const char *)(uintptr_t)len;
+			memcpy(&names[len], f->d_name, name_len);
+			len += name_len;
 		}
-		r = read(fd, &data[whead], size - whead);
-		if (r < 0) {
-			fprintf(stderr, "%s: read %s/%s: %s\n", argv0, KEYPATH, user, strerror(errno));
-			close(fd);
-			return 1;
-		}
-		whead += (size_t)r;
-
-		while (rhead2 < whead)
-			failed |= outputkey(data, whead, &rhead, &rhead2, &lineno, user);
 	}
 
-	if (rhead != whead) {
-		failed = 1;
-		fprintf(stderr, "%s: file truncated: %s/%s\n", argv0, KEYPATH, user);
-		if (memchr(&data[rhead], '\0', whead - rhead))
-			fprintf(stderr, "%s: NUL byte found in %s/%s on line %zu\n", argv0, KEYPATH, user, lineno + 1);
-	}
+	for (i = 0; i < n; i++)
+		users[i].name = &names[(uintptr_t)users[i].name];
+	qsort(users, n, sizeof(*users), usercmp);
 
-	close(fd);
-	return failed;
+	free(dirents);
+	*namesp = names;
+	*usersp = users;
+	*nusersp = n;
+	return 0;
+
+fail:
+	free(dirents);
+	free(names);
+	free(users);
+	return -1;
 }
 
 
 int
 main(int argc, char *argv[])
 {
-	int failed = 0, fd;
-	DIR *dir;
-	struct dirent *f;
+	struct scan scan;
+	char *names = NULL;
+	long int nprocs;
+	size_t workers, i;
+	const char *arg;
+	char *end;
+	int fd;
 
+	memset(&scan, 0, sizeof(scan));
+
+	/* -j, -s, -t, and -u change the cost report, and imply -c; -j also implies -u */
 	ARGBEGIN {
+	case 'c':
+		scan.report = 1;
+		break;
+	case 'j':
+		if (scan.max_threads)
+			usage();
+		arg = EARGF(usage());
+		if (!isdigit((unsigned char)*arg))
+			usage();
+		errno = 0;
+		scan.max_threads = (size_t)strtoul(arg, &end, 10);
+		if (errno || *end)
+			usage();
+		scan.totals = scan.report = 1;
+		break;
+	case 's':
+		scan.sorted = scan.report = 1;
+		break;
+	case 't':
+		arg = EARGF(usage());
+		if (!isdigit((unsigned char)*arg))
+			usage();
+		errno = 0;
+		scan.min_ms = (double)strtoul(arg, &end, 10);
+		if (errno || *end)
+			usage();
+		scan.report = 1;
+		break;
+	case 'u':
+		scan.totals = scan.report = 1;
+		break;
 	default:
 		usage();
 	} ARGEND;
 
+	/* as for key2root -j 0, the default is the number of processors */
+	if (!scan.max_threads) {
+		nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+		scan.max_threads = nprocs > 0 ? (size_t)nprocs : 1;
+	}
+
 	if (argc) {
 		fd = open(KEYPATH"/", O_PATH);
 		if (fd < 0) {
@@ -134,40 +565,62 @@ main(int argc, char *argv[])
 			fprintf(stderr, "%s: open %s/ O_PATH: %s\n", argv0, KEYPATH, strerror(errno));
 			exit(1);
 		}
-		for (; *argv; argv++) {
-			if (!(*argv)[0] || (*argv)[0] == '.' || strchr(*argv, '/') || strchr(*argv, '~')) {
-				fprintf(stderr, "%s: bad user name specified: %s\n", argv0, *argv);
-				failed = 1;
-			} else {
-				failed |= listkeys(fd, *argv);
+		scan.nusers = (size_t)argc;
+		scan.users = calloc(scan.nusers, sizeof(*scan.users));
+		if (!scan.users) {
+			fprintf(stderr, "%s: calloc: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < scan.nusers; i++) {
+			scan.users[i].name = argv[i];
+			if (!argv[i][0] || argv[i][0] == '.' || strchr(argv[i], '/') || strchr(argv[i], '~')) {
+				scan.users[i].bad = 1;
+				scan.users[i].failed = 1;
 			}
 		}
-		close(fd);
 	} else {
-		dir = opendir(KEYPATH"/");
-		if (!dir) {
+		fd = open(KEYPATH"/", O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
 			if (errno == ENOENT)
 				return 0;
-			fprintf(stderr, "%s: opendir %s/: %s\n", argv0, KEYPATH, strerror(errno));
+			fprintf(stderr, "%s: open %s/ O_DIRECTORY: %s\n", argv0, KEYPATH, strerror(errno));
 			exit(1);
 		}
-		fd = dirfd(dir);
-		if (fd < 0)
-			abort();
-		while ((errno = 0, f = readdir(dir))) {
-			if (f->d_name[0] == '.' || strchr(f->d_name, '~'))
-				continue;
-			listkeys(fd, f->d_name);
-		}
-		if (errno || closedir(dir)) {
-			fprintf(stderr, "%s: readdir %s/: %s\n", argv0, KEYPATH, strerror(errno));
+		if (readusers(fd, &names, &scan.users, &scan.nusers))
 			exit(1);
-		}
 	}
 
-	if (fflush(stdout) || ferror(stdout) || fclose(stdout)) {
-		fprintf(stderr, "%s: print: %s\n", argv0, strerror(errno));
+	/* the estimates are based on the time of a few small hashes on this machine */
+	if (scan.report && key2root_calibrate(&scan.calibration))
+		exit(1);
+
+	scan.buf = malloc(OUTPUT_SIZE);
+	if (!scan.buf) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	pthread_mutex_init(&scan.mutex, NULL);
+	scan.dir = fd;
+
+	/* the files are opened and read in parallel, as most of the time is spent waiting for them */
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = nprocs > 0 ? (size_t)nprocs : 1;
+	key2root_run_jobs(scan.nusers, workers, 0, NULL, listuser, &scan);
+	if (scan.sorted)
+		outputsorted(&scan);
+
+	pthread_mutex_destroy(&scan.mutex);
+	close(fd);
+
+	if (scan.print_failed || flushoutput(&scan) || close(STDOUT_FILENO)) {
+		if (!scan.print_failed)
+			fprintf(stderr, "%s: print: %s\n", argv0, strerror(errno));
 		exit(1);
 	}
-	return failed;
+
+	free(scan.buf);
+	free(scan.users);
+	free(names);
+	/* a listing of all users does not fail on individual key files */
+	return argc ? scan.failed : 0;
 }
@@ -1,9 +1,10 @@
 /* See LICENSE file for copyright and license details. */
-#include <sys/mman.h>
-#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,7 +14,18 @@
 #include <libenv.h>
 
 #include "arg.h"
+#include "cache.h"
+#include "conf.h"
 #include "crypt.h"
+#include "decode.h"
+#include "forward.h"
+#include "jobs.h"
+#include "keydb.h"
+#include "mapfile.h"
+#include "edit.h"
+#include "readkey.h"
+#include "scan.h"
+#include "trace.h"
 
 
 #define EXIT_AUTH   124
@@ -24,69 +36,60 @@
 
 char *argv0;
 
+struct candidate {
+	char *hash;
+	char *keyname;
+	const char *path;
+};
+
+static size_t max_threads = 0;
+static struct candidate *candidates = NULL;
+static size_t *candidate_lanes = NULL;
+static size_t ncandidates = 0;
+static uint_least32_t candidates_max_m_cost = 0;
+static pthread_mutex_t prehash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char prehash[KEY2ROOT_PREHASH_SIZE];
+static int have_prehash = 0;
+static const char *matched_path = NULL;
+static char *matched_keyname = NULL;
+static char *matched_hash = NULL;
+static struct key2root_config conf;
+static uintmax_t budget_used = 0;
+static int budget_exhausted = 0;
+
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-k key-name] [-e] command [argument] ...\n", argv0);
+	fprintf(stderr, "usage: %s [-k key-name] [-j max-threads] [-v] [-e] command [argument] ...\n", argv0);
 	exit(EXIT_ERROR);
 }
 
 
-static int
-forward(char *data, size_t len)
+static struct passwd *
+getroot(void)
 {
-	int fds[2];
-	size_t off;
-	ssize_t r;
-
-	/* We are using sockets because they cannot be hijacked via /proc/<pid>/fd/ */
-
-	if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fds)) {
-		fprintf(stderr, "%s: socketpair PF_LOCAL SOCK_STREAM 0: %s\n", argv0, strerror(errno));
-		return -1;
-	}
-	if (shutdown(fds[0], SHUT_WR)) {
-		fprintf(stderr, "%s: shutdown <socket> SHUT_WR: %s\n", argv0, strerror(errno));
-		close(fds[0]);
-		close(fds[1]);
-		return -1;
-	}
-	if (shutdown(fds[1], SHUT_RD)) {
-		fprintf(stderr, "%s: shutdown <socket> SHUT_RD: %s\n", argv0, strerror(errno));
-		close(fds[0]);
-		close(fds[1]);
-		return -1;
+	struct key2root_trace trace;
+	struct passwd *pw = NULL;
+	FILE *f;
+
+	/* the root user is local, so remote NSS sources need not be waited on */
+	key2root_trace_start(&trace);
+	f = fopen("/etc/passwd", "r");
+	if (f) {
+		while ((pw = fgetpwent(f)) && pw->pw_uid)
+			;
+		fclose(f);
 	}
+	key2root_trace_stop(&trace, "look up root in /etc/passwd: %s", pw ? "found" : "not found");
+	if (pw)
+		return pw;
 
-	switch (fork()) {
-	case -1:
-		fprintf(stderr, "%s: fork: %s\n", argv0, strerror(errno));
-		close(fds[0]);
-		close(fds[1]);
-		return -1;
-	case 0:
-		if (mlockall(MCL_CURRENT))
-			fprintf(stderr, "%s: mlockall MCL_CURRENT: %s\n", argv0, strerror(errno));
-		close(fds[0]);
-		break;
-	default:
-		close(fds[1]);
-		return fds[0];
-	}
-
-	for (off = 0; off < len; off += (size_t)r) {
-		r = write(fds[1], &data[off], len - off);
-		if (r < 0) {
-			fprintf(stderr, "%s: write <socket>: %s\n", argv0, strerror(errno));
-			close(fds[1]);
-			_exit(1);
-		}
-		explicit_bzero(&data[off], (size_t)r);
-	}
-
-	close(fds[1]);
-	_exit(0);
+	key2root_trace_start(&trace);
+	errno = 0;
+	pw = getpwuid(0);
+	key2root_trace_stop(&trace, "getpwuid 0");
+	return pw;
 }
 
 
@@ -97,8 +100,7 @@ set_environ(void)
 	size_t len;
 	struct passwd *pw;
 
-	errno = 0;
-	pw = getpwuid(0);
+	pw = getroot();
 	if (!pw) {
 		if (errno)
 			fprintf(stderr, "%s: getpwuid 0: %s\n", argv0, strerror(errno));
@@ -137,11 +139,8 @@ set_environ(void)
 
 
 static int
-hashequal(const char *a, const char *b)
+digestequal(const unsigned char *a, const unsigned char *b, size_t n)
 {
-	size_t an = strlen(a) + 1;
-	size_t bn = strlen(b) + 1;
-	size_t n = an < bn ? an : bn;
 	size_t i;
 	int diff = 0;
 	for (i = 0; i < n; i++)
@@ -150,113 +149,444 @@ hashequal(const char *a, const char *b)
 }
 
 
+static void
+use_prehash(char **keyp, size_t *key_lenp)
+{
+	/* the digest is computed once, no matter how many entries use it */
+	pthread_mutex_lock(&prehash_mutex);
+	if (!have_prehash) {
+		key2root_prehash(prehash, *keyp, *key_lenp);
+		have_prehash = 1;
+	}
+	pthread_mutex_unlock(&prehash_mutex);
+	*keyp = (char *)prehash;
+	*key_lenp = sizeof(prehash);
+}
+
+
 static int
-checkauth(char *data, size_t whead, size_t *rheadp, size_t *rhead2p, size_t *linenop, const char *path,
-          const char *keyname, size_t keyname_len, char *key, size_t key_len, int *key_foundp)
+verify_key(char *key, size_t key_len, const char *stored, size_t stored_len)
 {
-	int failed = 0, match;
-	char *hash, *sp;
-	size_t len;
+	size_t n = sizeof(KEY2ROOT_PREHASH_PREFIX) - 1;
+	if (stored_len > n && !memcmp(stored, KEY2ROOT_PREHASH_PREFIX"$", n + 1))
+		use_prehash(&key, &key_len);
+	return key2root_verify(key, key_len, stored, stored_len, 0);
+}
+
+
+static void
+setmatch(const char *path, const char *keyname, size_t keyname_len, const char *hash, size_t hash_len)
+{
+	matched_path = path;
+	free(matched_keyname);
+	free(matched_hash);
+	matched_keyname = strndup(keyname, keyname_len);
+	matched_hash = strndup(hash, hash_len);
+}
+
+
+/* Whether the configuration file allows a key hash with the specified costs to
+ * be checked; if so, its cost is charged to the budget of the invocation, and
+ * once the budget is used up, no further keys are checked */
+static int
+charge(const char *path, const char *keyname, size_t keyname_len,
+       uint_least32_t m_cost, uint_least32_t t_cost, uint_least32_t lanes)
+{
+	const char *exceeded;
+	uintmax_t cost = (uintmax_t)m_cost * t_cost;
+
+	if (budget_exhausted)
+		return 0;
+	exceeded = key2root_exceeds_limits(&conf, m_cost, t_cost, lanes);
+	if (exceeded) {
+		fprintf(stderr, "%s: key %.*s in %s exceeds %s in %s, skipped\n",
+		        argv0, (int)keyname_len, keyname, path, exceeded, CONFPATH);
+		return 0;
+	}
+	if (conf.budget && cost > conf.budget - budget_used) {
+		fprintf(stderr, "%s: budget in %s used up, no further keys are checked\n", argv0, CONFPATH);
+		budget_exhausted = 1;
+		return 0;
+	}
+	budget_used += cost;
+	return 1;
+}
 
-	while (*rhead2p < whead && data[*rhead2p] != '\n')
-		++*rhead2p;
 
-	if (data[*rhead2p] != '\n')
+static int
+admit(const char *path, const char *keyname, size_t keyname_len, const char *stored, size_t stored_len)
+{
+	uint_least32_t m_cost, t_cost, lanes;
+	int r;
+
+	if (!conf.max_memory && !conf.max_passes && !conf.max_lanes && !conf.budget)
+		return 1;
+	r = key2root_crypt_hash_cost(stored, stored_len, &m_cost, &t_cost, &lanes);
+	if (r && errno == ENOMEM) {
+		fprintf(stderr, "%s: decode %.*s: %s\n", argv0, (int)stored_len, stored, strerror(errno));
 		return 0;
+	}
+	/* a key hash that cannot be decoded is rejected by key2root_verify() without being computed */
+	return r ? !budget_exhausted : charge(path, keyname, keyname_len, m_cost, t_cost, lanes);
+}
+
+
+static void
+addcandidate(const char *hash, size_t hash_len, const char *path, const char *keyname, size_t keyname_len)
+{
+	void *new;
+	uint_least32_t m_cost, lanes;
+
+	new = realloc(candidates, (ncandidates + 1) * sizeof(*candidates));
+	if (!new)
+		goto fail;
+	candidates = new;
+	new = realloc(candidate_lanes, (ncandidates + 1) * sizeof(*candidate_lanes));
+	if (!new)
+		goto fail;
+	candidate_lanes = new;
+	candidates[ncandidates].hash = strndup(hash, hash_len);
+	if (!candidates[ncandidates].hash)
+		goto fail;
+	candidates[ncandidates].keyname = strndup(keyname, keyname_len);
+	if (!candidates[ncandidates].keyname) {
+		free(candidates[ncandidates].hash);
+		goto fail;
+	}
+	candidates[ncandidates].path = path;
+
+	if (key2root_crypt_cost(candidates[ncandidates].hash, &m_cost, NULL, &lanes) || !lanes)
+		m_cost = 0, lanes = 1;
+	if (m_cost > candidates_max_m_cost)
+		candidates_max_m_cost = m_cost;
+	candidate_lanes[ncandidates++] = (size_t)lanes;
+	return;
+
+fail:
+	fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
+}
 
-	len = *rhead2p - *rheadp;
-	*linenop += 1;
 
-	if (memchr(&data[*rheadp], '\0', len)) {
-		fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, *linenop);
+static int
+checkauth(const struct key2root_line *line, const char *path, const char *keyname, size_t keyname_len,
+          char *key, size_t key_len, int *key_foundp)
+{
+	int failed = 0, match;
+	const char *stored;
+	struct key2root_trace trace;
+	size_t stored_len;
+
+	if (line->has_nul) {
+		fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, line->lineno);
 		failed = 1;
 	}
-	sp = memchr(&data[*rheadp], ' ', len);
-	if (!sp) {
-		fprintf(stderr, "%s: no SP byte found in %s on line %zu\n", argv0, path, *linenop);
+	if (!line->sp) {
+		fprintf(stderr, "%s: no SP byte found in %s on line %zu\n", argv0, path, line->lineno);
 		failed = 1;
 	}
 
-	if (!failed && !keyname) {
-		keyname_len = (size_t)(sp - &data[*rheadp]);
-		goto check;
-	} else if (failed || keyname_len >= len || data[*rheadp + keyname_len] != ' ' ||
-	           memcmp(&data[*rheadp], keyname, keyname_len)) {
-		*rheadp = ++*rhead2p;
+	if (failed)
 		return 0;
-	} else {
-	check:
-		*rheadp += keyname_len + 1;
+	if (!keyname)
+		keyname_len = (size_t)(line->sp - line->data);
+	else if (keyname_len >= line->len || line->data[keyname_len] != ' ' || memcmp(line->data, keyname, keyname_len))
+		return 0;
+
+	*key_foundp = 1;
+	stored = &line->data[keyname_len + 1];
+	stored_len = line->len - keyname_len - 1;
+	if (!admit(path, line->data, keyname_len, stored, stored_len))
+		return 0;
+	if (max_threads) {
+		/* checked in parallel by checkcandidates() once all files have been read */
+		addcandidate(stored, stored_len, path, line->data, keyname_len);
+		return 0;
+	}
+	key2root_trace_start(&trace);
+	match = verify_key(key, key_len, stored, stored_len) > 0;
+	key2root_trace_stop(&trace, "check %.*s %.*s: %s", (int)keyname_len, line->data,
+	                    key2root_trace_parameters(stored, stored_len), stored, match ? "match" : "mismatch");
+	if (match)
+		setmatch(path, line->data, keyname_len, stored, stored_len);
+	return match;
+}
+
+
+static int
+checkentry(const struct key2root_keydb *db, const struct key2root_keydb_entry *entry, const char *path,
+           char *key, size_t key_len)
+{
+	struct libar2_argon2_parameters params;
+	const char *stored = &db->strings[entry->hash_offset];
+	unsigned char digest[KEY2ROOT_VERIFY_MAX_DIGEST];
+	const char *keyname = &db->strings[entry->name_offset];
+	size_t size;
+	int match;
+
+	if (entry->decoded ? !charge(path, keyname, entry->name_len, (uint_least32_t)entry->m_cost,
+	                             (uint_least32_t)entry->t_cost, (uint_least32_t)entry->lanes)
+	                   : !admit(path, keyname, entry->name_len, stored, entry->hash_len))
+		return 0;
+
+	if (max_threads) {
+		addcandidate(stored, entry->hash_len, path, keyname, entry->name_len);
+		return 0;
+	}
+
+	if (!entry->decoded)
+		return verify_key(key, key_len, stored, entry->hash_len) > 0;
+
+	memset(&params, 0, sizeof(params));
+	params.type = (enum libar2_argon2_type)entry->type;
+	params.version = (enum libar2_argon2_version)entry->version;
+	params.t_cost = (uint_least32_t)entry->t_cost;
+	params.m_cost = (uint_least32_t)entry->m_cost;
+	params.lanes = (uint_least32_t)entry->lanes;
+	params.salt = (unsigned char *)(uintptr_t)&db->strings[entry->salt_offset];
+	params.saltlen = (size_t)entry->salt_len;
+	params.hashlen = (size_t)entry->digest_len;
+
+	/* a digest too large for the buffer is verified from the key hash string instead */
+	size = libar2_hash_buf_size(&params);
+	if (!size || size > sizeof(digest))
+		return verify_key(key, key_len, stored, entry->hash_len) > 0;
+	if (entry->prehashed)
+		use_prehash(&key, &key_len);
+	if (key2root_hash(digest, key, key_len, &params, 0)) {
+		fprintf(stderr, "%s: libar2_hash %s: %s\n", argv0, stored, strerror(errno));
+		libar2_erase(digest, size);
+		return 0;
+	}
+	match = digestequal(digest, (const unsigned char *)&db->strings[entry->digest_offset], params.hashlen);
+	libar2_erase(digest, size);
+	return match;
+}
+
+
+static int
+authenticate_keydb(const char *path, const char *keyname, char *key, size_t key_len, int *key_foundp)
+{
+	struct key2root_keydb db;
+	const struct key2root_keydb_entry *entry = NULL;
+	struct key2root_trace trace;
+	const char *stored;
+	struct stat st;
+	size_t keyname_len = strlen(keyname);
+	int match = 0;
+
+	if (stat(path, &st))
+		return errno == ENOENT ? 0 : -1;
+	if (key2root_open_keydb(&db, path, &st))
+		return -1;
+
+	while (!match && !budget_exhausted && (entry = key2root_keydb_lookup(&db, keyname, keyname_len, entry))) {
 		*key_foundp = 1;
-		data[(*rhead2p)++] = '\0';
-		hash = key2root_crypt(key, key_len, &data[*rheadp], 0);
-		match = hash && hashequal(hash, &data[*rheadp]);
-		free(hash);
-		*rheadp = *rhead2p;
-		return match;
+		key2root_trace_start(&trace);
+		match = checkentry(&db, entry, path, key, key_len);
+		if (!max_threads) {
+			stored = &db.strings[entry->hash_offset];
+			key2root_trace_stop(&trace, "check %s %.*s (compiled): %s", keyname,
+			                    key2root_trace_parameters(stored, entry->hash_len), stored, match ? "match" : "mismatch");
+		}
 	}
+	if (match)
+		setmatch(path, keyname, keyname_len, &db.strings[entry->hash_offset], entry->hash_len);
+
+	key2root_close_keydb(&db);
+	return match;
 }
 
 
 static int
 authenticate(const char *path, const char *keyname, char *key, size_t key_len, int *key_foundp)
 {
-	int fd;
-	char *data = NULL;
-	size_t size = 0;
-	size_t whead = 0;
-	size_t rhead = 0;
-	size_t rhead2 = 0;
-	size_t lineno = 0;
-	ssize_t r = 1;
+	int fd, match = 0;
+	struct key2root_file file;
+	struct key2root_scanner scanner;
+	struct key2root_line line;
 	size_t keyname_len = keyname ? strlen(keyname) : 0;
 
+	if (budget_exhausted)
+		return 0;
+
+	/* Use the compiled key database, unless it is missing or stale, when a specific key is requested */
+	if (keyname && !strchr(keyname, ' ')) {
+		match = authenticate_keydb(path, keyname, key, key_len, key_foundp);
+		if (match >= 0)
+			return match;
+		match = 0;
+	}
+
 	fd = open(path, O_RDONLY);
 	if (fd < 0) {
 		if (errno != ENOENT)
 			fprintf(stderr, "%s: open %s O_RDONLY: %s\n", argv0, path, strerror(errno));
 		return 0;
 	}
+	if (key2root_load_file(fd, &file)) {
+		fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	close(fd);
 
-	while (r) {
-		if (whead == size) {
-			memmove(data, &data[rhead], whead -= rhead);
-			rhead2 -= rhead;
-			rhead = 0;
-			if (whead == size) {
-				data = realloc(data, size += 1024);
-				if (!data) {
-					fprintf(stderr, "%s: realloc: %s\n", argv0, strerror(errno));
-					close(fd);
-					return 0;
-				}
-			}
-		}
-		r = read(fd, &data[whead], size - whead);
-		if (r < 0) {
-			fprintf(stderr, "%s: read %s: %s\n", argv0, path, strerror(errno));
-			close(fd);
-			return 0;
-		}
-		whead += (size_t)r;
-
-		while (rhead2 < whead) {
-			if (checkauth(data, whead, &rhead, &rhead2, &lineno, path,
-			              keyname, keyname_len, key, key_len, key_foundp)) {
-				close(fd);
-				return 1;
-			}
+	key2root_scan_init(&scanner, file.data, file.len);
+	while (!budget_exhausted && key2root_scan_line(&scanner, &line)) {
+		if (checkauth(&line, path, keyname, keyname_len, key, key_len, key_foundp)) {
+			match = 1;
+			goto out;
 		}
 	}
 
-	if (rhead != whead) {
+	if (!budget_exhausted && scanner.pos != file.len) {
 		fprintf(stderr, "%s: file truncated: %s\n", argv0, path);
-		if (memchr(&data[rhead], '\0', whead - rhead))
-			fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, lineno + 1);
+		if (memchr(&file.data[scanner.pos], '\0', file.len - scanner.pos))
+			fprintf(stderr, "%s: NUL byte found in %s on line %zu\n", argv0, path, scanner.lineno + 1);
 	}
 
-	close(fd);
-	return 0;
+out:
+	key2root_unload_file(&file);
+	return match;
+}
+
+
+struct verification {
+	char *key;
+	size_t key_len;
+};
+
+
+static int
+checkcandidate(size_t i, void *user)
+{
+	struct verification *verification = user;
+	struct key2root_trace trace;
+	size_t len = strlen(candidates[i].hash);
+	int r, match;
+
+	key2root_trace_start(&trace);
+	r = verify_key(verification->key, verification->key_len, candidates[i].hash, len);
+	match = r > 0;
+	key2root_trace_stop(&trace, "check %s %.*s (parallel): %s", candidates[i].keyname,
+	                    key2root_trace_parameters(candidates[i].hash, len), candidates[i].hash,
+	                    match ? "match" : r ? "not completed" : "mismatch");
+	if (match)
+		key2root_crypt_cancel(); /* abort other hashes still running */
+	return match;
+}
+
+
+static int
+checkcandidates(char *key, size_t key_len)
+{
+	struct verification verification;
+	size_t i, stopped_by, n = ncandidates;
+
+	if (!n)
+		return 0;
+
+	verification.key = key;
+	verification.key_len = key_len;
+	key2root_crypt_reserve(candidates_max_m_cost);
+	/* a job costs as many threads as its hash has lanes, but at most max_threads,
+	 * and its hash must not start more threads than that */
+	key2root_crypt_limit_threads(max_threads);
+	stopped_by = key2root_run_jobs(n, max_threads, max_threads, candidate_lanes,
+	                               checkcandidate, &verification);
+
+	if (stopped_by < n)
+		setmatch(candidates[stopped_by].path, candidates[stopped_by].keyname, strlen(candidates[stopped_by].keyname),
+		         candidates[stopped_by].hash, strlen(candidates[stopped_by].hash));
+	for (i = 0; i < n; i++) {
+		free(candidates[i].hash);
+		free(candidates[i].keyname);
+	}
+	free(candidates);
+	free(candidate_lanes);
+	candidates = NULL;
+	candidate_lanes = NULL;
+	ncandidates = 0;
+
+	return stopped_by < n;
+}
+
+
+static void
+rehash(const char *parameters, char *key, size_t key_len)
+{
+	struct key2root_trace trace;
+	struct key2root_change change;
+	uint_least32_t m_cost;
+	char *params, *hash;
+	int r;
+
+	if (!matched_path || !matched_keyname || !matched_hash)
+		return;
+	/* a hash with a space could not be matched against the key file when it is rewritten */
+	r = strchr(matched_hash, ' ') ? -1 : key2root_crypt_differs(matched_hash, parameters);
+	if (r <= 0) {
+		key2root_trace_note("rehash %s: %s", matched_keyname, r ? "skipped" : "not needed");
+		return;
+	}
+
+	key2root_trace_start(&trace);
+	/* the new hash is prehashed if, and only if, the old one was */
+	if (key2root_prehashed(matched_hash)) {
+		use_prehash(&key, &key_len);
+		params = key2root_prehash_parameters(parameters);
+	} else {
+		params = strdup(key2root_prehashed(parameters) ? key2root_prehashed(parameters) : parameters);
+	}
+	if (!params) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return;
+	}
+	/* the parallel check cancels the hashes left when one matches */
+	key2root_crypt_resume();
+	if (!key2root_crypt_cost(params, &m_cost, NULL, NULL))
+		key2root_crypt_reserve(m_cost);
+	hash = key2root_crypt(key, key_len, params, 0);
+	free(params);
+	if (!hash)
+		return;
+
+	/* the line is only replaced if it is unchanged since it was checked */
+	change.keyname = matched_keyname;
+	change.hash = hash;
+	change.expect = matched_hash;
+	change.force = 1;
+	r = key2root_submit(&matched_path[sizeof(KEYPATH"/") - 1], &change, 1);
+	key2root_trace_stop(&trace, "rehash %s %.*s: %s", matched_keyname, key2root_trace_parameters(hash, strlen(hash)), hash,
+	                    r ? "failed" : change.found ? "replaced" : "changed concurrently");
+	free(hash);
+}
+
+
+static char *
+getnamepath(void)
+{
+	struct key2root_trace trace;
+	struct passwd *pwd;
+	char *path;
+
+	key2root_trace_start(&trace);
+	errno = 0;
+	pwd = getpwuid(getuid());
+	key2root_trace_stop(&trace, "getpwuid %ju", (uintmax_t)getuid());
+	if (!pwd || !pwd->pw_name || !*pwd->pw_name) {
+		if (errno)
+			fprintf(stderr, "%s: getpwuid: %s\n", argv0, strerror(errno));
+		else
+			fprintf(stderr, "%s: your user does not exist\n", argv0);
+		return NULL;
+	}
+	path = malloc(sizeof(KEYPATH"/") + strlen(pwd->pw_name));
+	if (!path) {
+		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
+		return NULL;
+	}
+	stpcpy(stpcpy(path, KEYPATH"/"), pwd->pw_name);
+	return path;
 }
 
 
@@ -265,14 +595,15 @@ main(int argc, char *argv[])
 {
 	int keep_env = 0;
 	const char *key_name = NULL;
-	char *key = NULL, *key_new;
-	size_t key_len = 0;
-	size_t key_size = 0;
-	ssize_t r;
-	int fd, key_found;
+	struct key2root_key key;
+	struct key2root_trace total, trace;
+	int fd, key_found, cached = 0, match = 0;
+	size_t n;
 	char path_user_id[sizeof(KEYPATH"/") + 3 * sizeof(uintmax_t)];
-	char *path_user_name;
-	struct passwd *pwd;
+	char *path_user_name = NULL;
+	const char *arg;
+	char *end;
+	long int nprocs;
 
 	ARGBEGIN {
 	case 'e':
@@ -283,6 +614,24 @@ main(int argc, char *argv[])
 			usage();
 		key_name = EARGF(usage());
 		break;
+	case 'j':
+		if (max_threads)
+			usage();
+		arg = EARGF(usage());
+		if (!isdigit((unsigned char)*arg))
+			usage();
+		errno = 0;
+		max_threads = (size_t)strtoul(arg, &end, 10);
+		if (errno || *end)
+			usage();
+		if (!max_threads) {
+			nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+			max_threads = nprocs > 0 ? (size_t)nprocs : 1;
+		}
+		break;
+	case 'v':
+		key2root_tracing = 1;
+		break;
 	default:
 		usage();
 	} ARGEND;
@@ -290,65 +639,91 @@ main(int argc, char *argv[])
 	if (!argc)
 		usage();
 
+	key2root_trace_start(&total);
+
+	key2root_trace_start(&trace);
+	if (key2root_load_config(&conf))
+		exit(EXIT_ERROR);
+	key2root_trace_stop(&trace, "load %s", CONFPATH);
+	key2root_trace_note("argon2 kernel: %s", key2root_crypt_kernel());
+
 	sprintf(path_user_id, "%s/%ju", KEYPATH, (uintmax_t)getuid());
-	errno = 0;
-	pwd = getpwuid(getuid());
-	if (!pwd || !pwd->pw_name || !*pwd->pw_name) {
-		if (errno)
-			fprintf(stderr, "%s: getpwuid: %s\n", argv0, strerror(errno));
-		else
-			fprintf(stderr, "%s: your user does not exist\n", argv0);
+
+	key2root_trace_start(&trace);
+	if (key2root_read_key(STDIN_FILENO, &key, 0)) {
+		fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
 		exit(EXIT_ERROR);
 	}
-	path_user_name = malloc(sizeof(KEYPATH"/") + strlen(pwd->pw_name));
-	if (!path_user_name) {
-		fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
-		exit(EXIT_ERROR);
+	key2root_trace_stop(&trace, "read %zu bytes from <stdin>", key.len);
+
+	key_found = 0;
+	if (conf.cache_timeout) {
+		key2root_trace_start(&trace);
+		match = cached = key2root_cache_check(getuid(), key.data, key.len, key_name, conf.cache_timeout);
+		key2root_trace_stop(&trace, "check credential cache: %s", cached ? "hit" : "miss");
 	}
-	stpcpy(stpcpy(path_user_name, KEYPATH"/"), pwd->pw_name);
-
-	for (;;) {
-		if (key_len == key_size) {
-			key_new = malloc(1 + (key_size += 1024));
-			if (!key_new) {
-				explicit_bzero(key, key_len);
-				fprintf(stderr, "%s: malloc: %s\n", argv0, strerror(errno));
-				exit(EXIT_ERROR);
-			}
-			memcpy(key_new, key, key_len);
-			explicit_bzero(key, key_len);
-			free(key);
-			key = key_new;
-		}
-		r = read(STDIN_FILENO, &key[key_len], key_size - key_len);
-		if (r <= 0) {
-			if (!r)
-				break;
-			explicit_bzero(key, key_len);
-			fprintf(stderr, "%s: read <stdin>: %s\n", argv0, strerror(errno));
+	if (!match) {
+		key2root_trace_start(&trace);
+		match = authenticate(path_user_id, key_name, key.data, key.len, &key_found);
+		key2root_trace_stop(&trace, "authenticate %s", path_user_id);
+	}
+	if (!match && ncandidates) {
+		n = ncandidates;
+		key2root_trace_start(&trace);
+		match = checkcandidates(key.data, key.len);
+		key2root_trace_stop(&trace, "check %zu entries with up to %zu threads", n, max_threads);
+	}
+	/* the user name is only looked up if needed, as NSS may have to ask a remote server */
+	if (!match) {
+		path_user_name = getnamepath();
+		if (!path_user_name) {
+			key2root_crypt_release();
+			key2root_free_key(&key);
+			explicit_bzero(prehash, sizeof(prehash));
 			exit(EXIT_ERROR);
 		}
-		key_len += (size_t)r;
+		key2root_trace_start(&trace);
+		match = authenticate(path_user_name, key_name, key.data, key.len, &key_found);
+		key2root_trace_stop(&trace, "authenticate %s", path_user_name);
+	} else {
+		key2root_trace_note("getpwuid %ju: skipped", (uintmax_t)getuid());
 	}
-
-	key_found = 0;
-	if (!authenticate(path_user_id, key_name, key, key_len, &key_found) &&
-	    !authenticate(path_user_name, key_name, key, key_len, &key_found)) {
+	if (!match && ncandidates) {
+		n = ncandidates;
+		key2root_trace_start(&trace);
+		match = checkcandidates(key.data, key.len);
+		key2root_trace_stop(&trace, "check %zu entries with up to %zu threads", n, max_threads);
+	}
+	if (!match) {
+		key2root_crypt_release();
 		fprintf(stderr, "%s: authentication failed: %s\n", argv0,
 		        key_name ? (key_found ? "key mismatch" : "key not found")
 		                 : (key_found ? "no matching key found" : "no key found"));
-		explicit_bzero(key, key_len);
+		key2root_free_key(&key);
+		explicit_bzero(prehash, sizeof(prehash));
 		exit(EXIT_AUTH);
 	}
+	/* the key file is rewritten before the credentials are cached, as the cache is tied to it */
+	if (conf.rehash_parameters && !cached)
+		rehash(conf.rehash_parameters, key.data, key.len);
+	key2root_crypt_release();
+	explicit_bzero(prehash, sizeof(prehash));
+
+	if (!cached && conf.cache_timeout && matched_path)
+		key2root_cache_store(getuid(), key.data, key.len, matched_path, matched_keyname);
 	free(path_user_name);
-
-	fd = forward(key, key_len);
-	if (fd < 0) {
-		explicit_bzero(key, key_len);
+	free(matched_keyname);
+	free(matched_hash);
+	key2root_free_config(&conf);
+
+	/* The key is always forwarded, even if the standard input is a file,
+	 * as the user could otherwise change the file after it was checked */
+	key2root_trace_start(&trace);
+	fd = key2root_forward(&key, 1);
+	key2root_free_key(&key);
+	if (fd < 0)
 		exit(EXIT_ERROR);
-	}
-
-	explicit_bzero(key, key_len);
+	key2root_trace_stop(&trace, "forward key");
 
 	if (setgid(0)) {
 		fprintf(stderr, "%s: setgid 0: %s\n", argv0, strerror(errno));
@@ -359,16 +734,20 @@ main(int argc, char *argv[])
 		exit(EXIT_ERROR);
 	}
 
-	if (fd != STDIN_FILENO) {
-		if (dup2(fd, STDIN_FILENO) != STDIN_FILENO) {
-			fprintf(stderr, "%s: dup2 <socket> <stdin>: %s\n", argv0, strerror(errno));
-			exit(EXIT_ERROR);
-		}
-		close(fd);
+	if (dup2(fd, STDIN_FILENO) != STDIN_FILENO) {
+		fprintf(stderr, "%s: dup2 <socket> <stdin>: %s\n", argv0, strerror(errno));
+		exit(EXIT_ERROR);
 	}
+	close(fd);
 
-	if (!keep_env)
+	if (!keep_env) {
+		key2root_trace_start(&trace);
 		set_environ();
+		key2root_trace_stop(&trace, "set environment");
+	} else {
+		key2root_trace_note("getpwuid 0: skipped");
+	}
+	key2root_trace_stop(&total, "total before executing %s", argv[0]);
 	execvp(argv[0], argv);
 	fprintf(stderr, "%s: execvpe %s: %s\n", argv0, argv[0], strerror(errno));
 	return errno == ENOENT ? EXIT_NOENT : EXIT_EXEC;
@@ -0,0 +1,361 @@
+/* See LICENSE file for copyright and license details. */
+#include "crypt.h"
+#include "decode.h"
+#include "keydb.h"
+#include "mapfile.h"
+#include "scan.h"
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libar2.h>
+
+
+uint32_t
+key2root_keydb_hash(const char *name, size_t len)
+{
+	uint32_t hash = UINT32_C(2166136261);
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= UINT32_C(16777619);
+	}
+	return hash;
+}
+
+
+static int
+writeall(int fd, const char *data, size_t len)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < len) {
+		r = write(fd, &data[off], len - off);
+		if (r < 0)
+			return -1;
+		off += (size_t)r;
+	}
+
+	return 0;
+}
+
+
+/* Only key hashes in the form that key2root_verify() checks by comparing digests are decoded,
+ * other entries are left to key2root_verify(), so that both accept the same key hashes */
+static void
+decode(struct key2root_keydb_entry *entry, char *strings, size_t *offp)
+{
+	struct libar2_argon2_parameters params;
+	unsigned char salt[KEY2ROOT_VERIFY_MAX_SALT], tag[KEY2ROOT_VERIFY_MAX_DIGEST];
+	const char *hash = &strings[entry->hash_offset];
+	int prehashed = 0;
+
+	if (key2root_prehashed(hash)) {
+		hash = key2root_prehashed(hash);
+		prehashed = 1;
+	}
+	if (key2root_decode_hash(hash, &strings[entry->hash_offset + entry->hash_len], &params, salt, tag))
+		return;
+
+	entry->digest_offset = (uint32_t)*offp;
+	entry->digest_len = (uint32_t)params.hashlen;
+	memcpy(&strings[*offp], tag, params.hashlen);
+	*offp += params.hashlen;
+	entry->salt_offset = (uint32_t)*offp;
+	entry->salt_len = (uint32_t)params.saltlen;
+	memcpy(&strings[*offp], salt, params.saltlen);
+	*offp += params.saltlen;
+	entry->type = (uint32_t)params.type;
+	entry->version = (uint32_t)params.version;
+	entry->m_cost = (uint32_t)params.m_cost;
+	entry->t_cost = (uint32_t)params.t_cost;
+	entry->lanes = (uint32_t)params.lanes;
+	entry->prehashed = (uint32_t)prehashed;
+	entry->decoded = 1;
+
+	libar2_erase(tag, params.hashlen);
+	libar2_erase(salt, params.saltlen);
+}
+
+
+int
+key2root_compile_keydb(const char *path, const char *data, size_t len, const struct stat *st)
+{
+	struct key2root_keydb_header *header;
+	struct key2root_keydb_entry *entries, *entry;
+	uint32_t *buckets;
+	char *buf = NULL, *strings, *dbpath = NULL, *tmppath = NULL;
+	struct key2root_scanner scanner;
+	struct key2root_line line;
+	const char *name, *nl, *sp;
+	size_t nentries = 0, nbuckets = 1, strings_size = 0, size, off, i;
+	int fd, saved_errno;
+
+	/* Count the usable lines and bound the size of the string pool, a decoded salt
+	 * or digest is never larger than its encoding, which is also stored, and the
+	 * hash string is stored with a NUL byte in place of the LF byte */
+	key2root_scan_init(&scanner, data, len);
+	while (key2root_scan_line(&scanner, &line)) {
+		if (line.has_nul || !line.sp)
+			continue;
+		nentries += 1;
+		strings_size += 3 * line.len;
+	}
+	if (nentries > UINT32_MAX / 2 || strings_size > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	while (nbuckets < 2 * nentries)
+		nbuckets <<= 1;
+
+	size = sizeof(*header) + nbuckets * sizeof(*buckets) + nentries * sizeof(*entries) + strings_size;
+	buf = calloc(1, size);
+	dbpath = malloc(strlen(path) + sizeof(KEY2ROOT_KEYDB_SUFFIX"~"));
+	if (!buf || !dbpath)
+		goto fail;
+	stpcpy(stpcpy(dbpath, path), KEY2ROOT_KEYDB_SUFFIX);
+	tmppath = malloc(strlen(dbpath) + sizeof("~"));
+	if (!tmppath)
+		goto fail;
+	stpcpy(stpcpy(tmppath, dbpath), "~");
+
+	header = (void *)buf;
+	buckets = (void *)&header[1];
+	entries = (void *)&buckets[nbuckets];
+	strings = (void *)&entries[nentries];
+
+	off = 0;
+	entry = entries;
+	key2root_scan_init(&scanner, data, len);
+	while (key2root_scan_line(&scanner, &line)) {
+		if (line.has_nul || !line.sp)
+			continue;
+		name = line.data;
+		sp = line.sp;
+		nl = &line.data[line.len];
+		entry->lineno = (uint32_t)line.lineno;
+		entry->name_offset = (uint32_t)off;
+		entry->name_len = (uint32_t)(sp - name);
+		entry->name_hash = key2root_keydb_hash(name, (size_t)(sp - name));
+		memcpy(&strings[off], name, (size_t)(sp - name));
+		off += (size_t)(sp - name);
+		entry->hash_offset = (uint32_t)off;
+		entry->hash_len = (uint32_t)(nl - &sp[1]);
+		memcpy(&strings[off], &sp[1], (size_t)(nl - &sp[1]));
+		off += (size_t)(nl - &sp[1]);
+		strings[off++] = '\0';
+		decode(entry, strings, &off);
+		entry++;
+	}
+
+	/* Chain entries in file order so that duplicate names are checked in the same order as in the key file */
+	for (i = nentries; i--;) {
+		entries[i].next = buckets[entries[i].name_hash & (nbuckets - 1)];
+		buckets[entries[i].name_hash & (nbuckets - 1)] = (uint32_t)(i + 1);
+	}
+
+	memcpy(header->magic, KEY2ROOT_KEYDB_MAGIC, sizeof(header->magic));
+	header->version = KEY2ROOT_KEYDB_VERSION;
+	header->source_dev = (uint64_t)st->st_dev;
+	header->source_ino = (uint64_t)st->st_ino;
+	header->source_size = (uint64_t)st->st_size;
+	header->source_mtime_sec = (int64_t)st->st_mtim.tv_sec;
+	header->source_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+	header->source_ctime_sec = (int64_t)st->st_ctim.tv_sec;
+	header->source_ctime_nsec = (int64_t)st->st_ctim.tv_nsec;
+	header->nbuckets = (uint32_t)nbuckets;
+	header->nentries = (uint32_t)nentries;
+	header->strings_size = (uint32_t)off;
+	size -= strings_size - off;
+
+	/* the user's lock is held, so the temporary file can only be left over from a crash */
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto fail;
+	if (writeall(fd, buf, size)) {
+		close(fd);
+		goto fail_unlink;
+	}
+	if (close(fd) || rename(tmppath, dbpath))
+		goto fail_unlink;
+
+	libar2_erase(buf, size);
+	free(buf);
+	free(dbpath);
+	free(tmppath);
+	return 0;
+
+fail_unlink:
+	saved_errno = errno;
+	unlink(tmppath);
+	errno = saved_errno;
+fail:
+	saved_errno = errno;
+	if (buf)
+		libar2_erase(buf, size);
+	free(buf);
+	free(dbpath);
+	free(tmppath);
+	errno = saved_errno;
+	return -1;
+}
+
+
+int
+key2root_recompile_keydb(const char *path)
+{
+	struct key2root_file file;
+	struct stat st;
+	char *dbpath;
+	int fd, ret = -1, saved_errno;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			return -1;
+		/* the key file has been removed, so the database must be removed too */
+		dbpath = malloc(strlen(path) + sizeof(KEY2ROOT_KEYDB_SUFFIX));
+		if (!dbpath)
+			return -1;
+		stpcpy(stpcpy(dbpath, path), KEY2ROOT_KEYDB_SUFFIX);
+		if (!unlink(dbpath) || errno == ENOENT)
+			ret = 0;
+		saved_errno = errno;
+		free(dbpath);
+		errno = saved_errno;
+		return ret;
+	}
+
+	if (!fstat(fd, &st) && !key2root_load_file(fd, &file)) {
+		ret = key2root_compile_keydb(path, file.data, file.len, &st);
+		saved_errno = errno;
+		key2root_unload_file(&file);
+		errno = saved_errno;
+	}
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+
+int
+key2root_open_keydb(struct key2root_keydb *db, const char *path, const struct stat *st)
+{
+	const struct key2root_keydb_header *header;
+	struct stat dbst;
+	char *dbpath;
+	uint64_t size;
+	int fd;
+
+	dbpath = malloc(strlen(path) + sizeof(KEY2ROOT_KEYDB_SUFFIX));
+	if (!dbpath)
+		return -1;
+	stpcpy(stpcpy(dbpath, path), KEY2ROOT_KEYDB_SUFFIX);
+	fd = open(dbpath, O_RDONLY);
+	free(dbpath);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &dbst) || dbst.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		errno = EBADMSG;
+		return -1;
+	}
+	db->map_size = (size_t)dbst.st_size;
+	db->map = mmap(NULL, db->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED)
+		return -1;
+
+	header = db->header = db->map;
+	if (memcmp(header->magic, KEY2ROOT_KEYDB_MAGIC, sizeof(header->magic)) ||
+	    header->version != KEY2ROOT_KEYDB_VERSION ||
+	    !header->nbuckets || (header->nbuckets & (header->nbuckets - 1)))
+		goto bad;
+	size = sizeof(*header);
+	size += (uint64_t)header->nbuckets * sizeof(*db->buckets);
+	size += (uint64_t)header->nentries * sizeof(*db->entries);
+	size += (uint64_t)header->strings_size;
+	if (size != (uint64_t)db->map_size)
+		goto bad;
+
+	/* The database is stale if the key file has been modified since it was compiled */
+	if (header->source_dev != (uint64_t)st->st_dev ||
+	    header->source_ino != (uint64_t)st->st_ino ||
+	    header->source_size != (uint64_t)st->st_size ||
+	    header->source_mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+	    header->source_mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+	    header->source_ctime_sec != (int64_t)st->st_ctim.tv_sec ||
+	    header->source_ctime_nsec != (int64_t)st->st_ctim.tv_nsec) {
+		munmap(db->map, db->map_size);
+		errno = ESTALE;
+		return -1;
+	}
+
+	db->buckets = (const void *)&header[1];
+	db->entries = (const void *)&db->buckets[header->nbuckets];
+	db->strings = (const void *)&db->entries[header->nentries];
+	return 0;
+
+bad:
+	munmap(db->map, db->map_size);
+	errno = EBADMSG;
+	return -1;
+}
+
+
+static int
+validentry(const struct key2root_keydb *db, const struct key2root_keydb_entry *entry)
+{
+	uint64_t strings_size = db->header->strings_size;
+
+	if ((uint64_t)entry->name_offset + entry->name_len > strings_size ||
+	    (uint64_t)entry->hash_offset + entry->hash_len >= strings_size ||
+	    db->strings[entry->hash_offset + entry->hash_len])
+		return 0;
+	if (entry->decoded &&
+	    ((uint64_t)entry->salt_offset + entry->salt_len > strings_size ||
+	     (uint64_t)entry->digest_offset + entry->digest_len > strings_size))
+		return 0;
+	return 1;
+}
+
+
+const struct key2root_keydb_entry *
+key2root_keydb_lookup(const struct key2root_keydb *db, const char *name, size_t len,
+                      const struct key2root_keydb_entry *prev)
+{
+	uint32_t hash = key2root_keydb_hash(name, len);
+	uint32_t next, i;
+
+	if (prev) {
+		i = (uint32_t)(prev - db->entries);
+		next = prev->next;
+	} else {
+		i = 0;
+		next = db->buckets[hash & (db->header->nbuckets - 1)];
+	}
+
+	/* chains are in ascending order, which also guarantees that a corrupt database cannot cause a loop */
+	for (; next; next = db->entries[i].next) {
+		if (next > db->header->nentries || (prev && next <= i + 1))
+			break;
+		prev = &db->entries[i = next - 1];
+		if (prev->name_hash == hash && prev->name_len == len && validentry(db, prev) &&
+		    !memcmp(&db->strings[prev->name_offset], name, len))
+			return prev;
+	}
+
+	return NULL;
+}
+
+
+void
+key2root_close_keydb(struct key2root_keydb *db)
+{
+	munmap(db->map, db->map_size);
+	db->map = NULL;
+}
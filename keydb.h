@@ -0,0 +1,66 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY2ROOT_KEYDB_SUFFIX "~db"
+#define KEY2ROOT_KEYDB_MAGIC "K2RKEYDB"
+#define KEY2ROOT_KEYDB_VERSION 3
+
+
+/* All integers are in host byte order, the database is only used on the host that compiled it */
+struct key2root_keydb_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t source_dev;
+	uint64_t source_ino;
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	int64_t source_ctime_sec;
+	int64_t source_ctime_nsec;
+	uint32_t nbuckets; /* power of two */
+	uint32_t nentries;
+	uint32_t strings_size;
+	uint32_t padding;
+	/* followed by uint32_t buckets[nbuckets], entries[nentries], and char strings[strings_size] */
+};
+
+struct key2root_keydb_entry {
+	uint32_t next; /* index + 1 of the next entry in the same bucket, 0 at the end */
+	uint32_t name_hash;
+	uint32_t lineno;
+	uint32_t name_offset;
+	uint32_t name_len;
+	uint32_t hash_offset; /* key hash string as stored in the key file, NUL-terminated */
+	uint32_t hash_len;
+	uint32_t decoded; /* whether the fields below are set */
+	uint32_t type;
+	uint32_t version;
+	uint32_t m_cost;
+	uint32_t t_cost;
+	uint32_t lanes;
+	uint32_t salt_offset;
+	uint32_t salt_len;
+	uint32_t digest_offset;
+	uint32_t digest_len;
+	uint32_t prehashed; /* whether the key shall be hashed with key2root_prehash() first */
+};
+
+struct key2root_keydb {
+	void *map;
+	size_t map_size;
+	const struct key2root_keydb_header *header;
+	const uint32_t *buckets;
+	const struct key2root_keydb_entry *entries;
+	const char *strings;
+};
+
+
+uint32_t key2root_keydb_hash(const char *name, size_t len);
+int key2root_compile_keydb(const char *path, const char *data, size_t len, const struct stat *st);
+int key2root_recompile_keydb(const char *path);
+int key2root_open_keydb(struct key2root_keydb *db, const char *path, const struct stat *st);
+const struct key2root_keydb_entry *key2root_keydb_lookup(const struct key2root_keydb *db, const char *name, size_t len,
+                                                         const struct key2root_keydb_entry *prev);
+void key2root_close_keydb(struct key2root_keydb *db);
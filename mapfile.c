@@ -0,0 +1,76 @@
+/* See LICENSE file for copyright and license details. */
+#include "mapfile.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+int
+key2root_load_file(int fd, struct key2root_file *file)
+{
+	struct stat st;
+	char *new;
+	ssize_t r;
+
+	file->data = NULL;
+	file->len = 0;
+	file->size = 0;
+	file->mapped = 0;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	/* Regular files are mapped rather than copied, everything
+	 * that parses the files only reads the data */
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		if ((uintmax_t)st.st_size > SIZE_MAX) {
+			errno = EFBIG;
+			return -1;
+		}
+		file->data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->data != MAP_FAILED) {
+			file->len = file->size = (size_t)st.st_size;
+			file->mapped = 1;
+			madvise(file->data, file->size, MADV_SEQUENTIAL);
+			return 0;
+		}
+		file->data = NULL;
+	}
+
+	for (;;) {
+		if (file->len == file->size) {
+			new = realloc(file->data, file->size = file->size ? file->size * 2 : 4096);
+			if (!new)
+				goto fail;
+			file->data = new;
+		}
+		r = read(fd, &file->data[file->len], file->size - file->len);
+		if (r <= 0) {
+			if (!r)
+				return 0;
+			goto fail;
+		}
+		file->len += (size_t)r;
+	}
+
+fail:
+	free(file->data);
+	file->data = NULL;
+	return -1;
+}
+
+
+void
+key2root_unload_file(struct key2root_file *file)
+{
+	if (file->mapped)
+		munmap(file->data, file->size);
+	else
+		free(file->data);
+	file->data = NULL;
+	file->len = file->size = 0;
+	file->mapped = 0;
+}
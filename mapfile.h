@@ -0,0 +1,12 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+
+struct key2root_file {
+	char *data;
+	size_t len;
+	size_t size;
+	int mapped;
+};
+
+int key2root_load_file(int fd, struct key2root_file *file);
+void key2root_unload_file(struct key2root_file *file);
@@ -0,0 +1,132 @@
+/* See LICENSE file for copyright and license details. */
+#include "readkey.h"
+#include "crypt.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+
+#define INITIAL_SIZE (64 << 10)
+
+
+static int
+map_file(int fd, struct key2root_key *key, const struct stat *st)
+{
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	off_t offset, map_offset;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st->st_size || (uintmax_t)(st->st_size - offset) > SIZE_MAX / 2)
+		return -1;
+	map_offset = offset & ~(off_t)(pagesize - 1);
+
+	key->map_size = (size_t)(st->st_size - map_offset);
+	key->map = mmap(NULL, key->map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	if (key->map == MAP_FAILED)
+		return -1;
+	if (lseek(fd, st->st_size, SEEK_SET) < 0) {
+		munmap(key->map, key->map_size);
+		return -1;
+	}
+	madvise(key->map, key->map_size, MADV_SEQUENTIAL);
+	madvise(key->map, key->map_size, MADV_DONTDUMP);
+
+	key->data = &((char *)key->map)[offset - map_offset];
+	key->len = (size_t)(st->st_size - offset);
+	key->from_file = 1;
+	return 0;
+}
+
+
+static int
+grow(struct key2root_key *key, size_t size)
+{
+	void *new;
+
+	/* mremap(2) moves the pages rather than copying them, and a
+	 * locked mapping remains locked, so the key is never duplicated */
+	new = mremap(key->map, key->map_size, size, MREMAP_MAYMOVE);
+	if (new == MAP_FAILED)
+		return -1;
+	key->map = new;
+	key->map_size = size;
+	key->data = new;
+	return 0;
+}
+
+
+int
+key2root_read_key(int fd, struct key2root_key *key, int may_map)
+{
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = INITIAL_SIZE;
+	struct stat st;
+	ssize_t r;
+
+	key->data = NULL;
+	key->len = 0;
+	key->map = NULL;
+	key->map_size = 0;
+	key->from_file = 0;
+
+	if (fstat(fd, &st))
+		return -1;
+	if (S_ISREG(st.st_mode)) {
+		if (may_map && !map_file(fd, key, &st))
+			return 0;
+		/* if the file is not mapped, it is read into a buffer of the right size */
+		if (st.st_size > 0 && (uintmax_t)st.st_size < SIZE_MAX / 2)
+			size = ((size_t)st.st_size + pagesize) & ~(pagesize - 1);
+	}
+
+	key->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (key->map == MAP_FAILED) {
+		key->map = NULL;
+		return -1;
+	}
+	key->map_size = size;
+	key->data = key->map;
+	mlock(key->map, key->map_size); /* best effort, limited by RLIMIT_MEMLOCK unless privileged */
+	madvise(key->map, key->map_size, MADV_DONTDUMP);
+
+	for (;;) {
+		if (key->len == key->map_size) {
+			if (key->map_size > SIZE_MAX / 2) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			if (grow(key, key->map_size * 2))
+				goto fail;
+		}
+		r = read(fd, &key->data[key->len], key->map_size - key->len);
+		if (r <= 0) {
+			if (!r)
+				return 0;
+			goto fail;
+		}
+		key->len += (size_t)r;
+	}
+
+fail:
+	key2root_free_key(key);
+	return -1;
+}
+
+
+void
+key2root_free_key(struct key2root_key *key)
+{
+	int saved_errno = errno;
+	if (key->map) {
+		if (!key->from_file)
+			explicit_bzero(key->data, key->len);
+		munmap(key->map, key->map_size);
+	}
+	key->data = NULL;
+	key->len = 0;
+	key->map = NULL;
+	key->map_size = 0;
+	errno = saved_errno;
+}
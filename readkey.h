@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/types.h>
+#include <stddef.h>
+
+struct key2root_key {
+	char *data;
+	size_t len;
+	void *map;
+	size_t map_size;
+	int from_file; /* data is mapped from the input file, and is read-only */
+};
+
+/* A regular file is mapped, rather than copied, only if may_map is set; a
+ * mapping shows later changes to the file, so a setuid program must not map */
+int key2root_read_key(int fd, struct key2root_key *key, int may_map);
+void key2root_free_key(struct key2root_key *key);
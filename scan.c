@@ -0,0 +1,217 @@
+/* See LICENSE file for copyright and license details. */
+#include "scan.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define X86_KERNELS
+# include <immintrin.h>
+#endif
+
+
+/* A kernel returns the offset of the first LF byte, or `len` if there is
+ * none, and finds the first SP byte and any NUL byte before it */
+struct kernel {
+	const char *name;
+	int (*supported)(void);
+	size_t (*find)(const char *s, size_t len, size_t *spp, int *nulp);
+};
+
+
+static size_t
+find_portable(const char *s, size_t len, size_t *spp, int *nulp)
+{
+	const char *nl, *sp;
+	size_t n;
+
+	nl = memchr(s, '\n', len);
+	n = nl ? (size_t)(nl - s) : len;
+	sp = memchr(s, ' ', n);
+	*spp = sp ? (size_t)(sp - s) : SIZE_MAX;
+	*nulp = !!memchr(s, '\0', n);
+	return n;
+}
+
+
+#ifdef X86_KERNELS
+
+/* The vector kernels compare a vector at a time against LF, SP, and NUL,
+ * so each byte of a line is only loaded once, and only vectors containing
+ * any of them are looked at closer; SP bytes are only looked for until the
+ * first is found. The last bytes of the file, which do not fill a vector,
+ * are compared one by one */
+
+static size_t
+find_tail(const char *s, size_t i, size_t len, size_t sp, int nul, size_t *spp, int *nulp)
+{
+	for (; i < len && s[i] != '\n'; i++) {
+		if (s[i] == ' ' && sp == SIZE_MAX)
+			sp = i;
+		nul |= !s[i];
+	}
+	*spp = sp;
+	*nulp = nul;
+	return i;
+}
+
+
+/* Takes the masks for the vector at offset `i`, and returns
+ * the offset of the LF byte, or SIZE_MAX if there is none */
+static size_t
+find_vector(uint32_t mnl, uint32_t msp, uint32_t mnul, size_t i, size_t *spp, int *nulp)
+{
+	uint32_t before = mnl ? (mnl & -mnl) - 1 : UINT32_MAX;
+
+	if (*spp == SIZE_MAX && (msp &= before))
+		*spp = i + (size_t)__builtin_ctz(msp);
+	*nulp |= !!(mnul & before);
+	return mnl ? i + (size_t)__builtin_ctz(mnl) : SIZE_MAX;
+}
+
+
+static int
+have_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+
+#define FIND(LOAD, MASK)\
+	do {\
+		uint32_t mnl, msp, mnul;\
+		size_t i, sp = SIZE_MAX, end;\
+		int nul = 0;\
+		for (i = 0; i + sizeof(x) <= len; i += sizeof(x)) {\
+			x = LOAD((const void *)&s[i]);\
+			mnl = MASK(x, nl);\
+			mnul = MASK(x, zero);\
+			msp = sp == SIZE_MAX ? MASK(x, space) : 0;\
+			if (msp | mnl | mnul) {\
+				end = find_vector(mnl, msp, mnul, i, &sp, &nul);\
+				if (end != SIZE_MAX) {\
+					*spp = sp;\
+					*nulp = nul;\
+					return end;\
+				}\
+			}\
+		}\
+		return find_tail(s, i, len, sp, nul, spp, nulp);\
+	} while (0)
+
+
+__attribute__((target("sse2")))
+static size_t
+find_sse2(const char *s, size_t len, size_t *spp, int *nulp)
+{
+	const __m128i nl = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' '), zero = _mm_setzero_si128();
+	__m128i x;
+#define MASK(X, C) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8((X), (C))))
+	FIND(_mm_loadu_si128, MASK);
+#undef MASK
+}
+
+
+static int
+have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+find_avx2(const char *s, size_t len, size_t *spp, int *nulp)
+{
+	const __m256i nl = _mm256_set1_epi8('\n'), space = _mm256_set1_epi8(' '), zero = _mm256_setzero_si256();
+	__m256i x;
+#define MASK(X, C) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((X), (C))))
+	FIND(_mm256_loadu_si256, MASK);
+#undef MASK
+}
+
+#undef FIND
+
+#endif
+
+
+/* The first supported kernel is used, the portable kernel must be last */
+static const struct kernel kernels[] = {
+#ifdef X86_KERNELS
+	{"avx2", have_avx2, find_avx2},
+	{"sse2", have_sse2, find_sse2},
+#endif
+	{"portable", NULL, find_portable}
+};
+
+static const struct kernel *kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+
+static void
+select_kernel(void)
+{
+	const char *name = NULL;
+	size_t i;
+
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+#endif
+
+	/* as for KEY2ROOT_ARGON2_KERNEL, a kernel can be forced for testing and benchmarking */
+	if (getuid() == geteuid() && getgid() == getegid())
+		name = getenv("KEY2ROOT_SCAN_KERNEL");
+	for (i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+		if (kernels[i].supported && !kernels[i].supported())
+			continue;
+		if (!kernel)
+			kernel = &kernels[i];
+		if (name && !strcmp(name, kernels[i].name)) {
+			kernel = &kernels[i];
+			break;
+		}
+	}
+}
+
+
+const char *
+key2root_scan_kernel(void)
+{
+	pthread_once(&kernel_once, select_kernel);
+	return kernel->name;
+}
+
+
+void
+key2root_scan_init(struct key2root_scanner *scanner, const char *data, size_t len)
+{
+	pthread_once(&kernel_once, select_kernel);
+	scanner->data = data;
+	scanner->len = len;
+	scanner->pos = 0;
+	scanner->lineno = 0;
+}
+
+
+/* Returns 0 when there are no more complete lines */
+int
+key2root_scan_line(struct key2root_scanner *scanner, struct key2root_line *line)
+{
+	const char *s;
+	size_t left = scanner->len - scanner->pos, n, sp;
+
+	if (!left)
+		return 0;
+	s = &scanner->data[scanner->pos];
+	n = kernel->find(s, left, &sp, &line->has_nul);
+	if (n == left)
+		return 0;
+	line->data = s;
+	line->len = n;
+	line->sp = sp == SIZE_MAX ? NULL : &s[sp];
+	line->lineno = ++scanner->lineno;
+	scanner->pos += n + 1;
+	return 1;
+}
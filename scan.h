@@ -0,0 +1,21 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+
+struct key2root_line {
+	const char *data; /* the line, without the LF byte */
+	size_t len;
+	size_t lineno;
+	const char *sp; /* the first SP byte, NULL if there is none */
+	int has_nul;
+};
+
+struct key2root_scanner {
+	const char *data;
+	size_t len;
+	size_t pos; /* where the next line begins, less than len at the end if the file is truncated */
+	size_t lineno;
+};
+
+void key2root_scan_init(struct key2root_scanner *scanner, const char *data, size_t len);
+int key2root_scan_line(struct key2root_scanner *scanner, struct key2root_line *line);
+const char *key2root_scan_kernel(void);
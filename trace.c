@@ -0,0 +1,84 @@
+/* See LICENSE file for copyright and license details. */
+#include "trace.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+
+extern char *argv0;
+
+int key2root_tracing = 0;
+
+
+static double
+elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) * 1000. + (double)(end->tv_nsec - start->tv_nsec) / 1000000.;
+}
+
+
+void
+key2root_trace_start(struct key2root_trace *trace)
+{
+	if (!key2root_tracing)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &trace->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &trace->cpu);
+	getrusage(RUSAGE_SELF, &trace->usage);
+}
+
+
+void
+key2root_trace_stop(const struct key2root_trace *trace, const char *fmt, ...)
+{
+	struct timespec wall, cpu;
+	struct rusage usage;
+	char what[512];
+	va_list ap;
+
+	if (!key2root_tracing)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	getrusage(RUSAGE_SELF, &usage);
+
+	va_start(ap, fmt);
+	vsnprintf(what, sizeof(what), fmt, ap);
+	va_end(ap);
+
+	/* CPU time and page faults are for the whole process, so
+	 * they include other hashes running in parallel with -j */
+	fprintf(stderr, "%s: trace: %s: wall %.3f ms, cpu %.3f ms, minflt %ld, majflt %ld, maxrss %ld KiB\n",
+	        argv0, what, elapsed(&trace->wall, &wall), elapsed(&trace->cpu, &cpu),
+	        usage.ru_minflt - trace->usage.ru_minflt, usage.ru_majflt - trace->usage.ru_majflt,
+	        usage.ru_maxrss);
+}
+
+
+void
+key2root_trace_note(const char *fmt, ...)
+{
+	char what[512];
+	va_list ap;
+
+	if (!key2root_tracing)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(what, sizeof(what), fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "%s: trace: %s\n", argv0, what);
+}
+
+
+int
+key2root_trace_parameters(const char *hash, size_t len)
+{
+	/* the length of the hash string without the salt and the hash itself, for
+	 * "%.*s", as key2root is setuid and the key files are only readable by
+	 * root; nothing is printed of a string that is not in that format */
+	size_t n = len;
+	int separators = 0;
+	while (n)
+		if (hash[--n] == '$' && ++separators == 2)
+			return (int)n;
+	return 0;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+#include <sys/resource.h>
+#include <stddef.h>
+#include <time.h>
+
+struct key2root_trace {
+	struct timespec wall;
+	struct timespec cpu;
+	struct rusage usage;
+};
+
+extern int key2root_tracing;
+
+void key2root_trace_start(struct key2root_trace *trace);
+void key2root_trace_stop(const struct key2root_trace *trace, const char *fmt, ...);
+void key2root_trace_note(const char *fmt, ...);
+int key2root_trace_parameters(const char *hash, size_t len);
@@ -0,0 +1,267 @@
+/* See LICENSE file for copyright and license details. */
+#include "crypt.h"
+#include "tune.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define DEFAULT_MAX_MEMORY (UINT32_C(1) << 20) /* 1 GiB */
+#define DEFAULT_MAX_LANES 8
+#define PROBE_MEMORY (UINT32_C(16) << 10) /* 16 MiB */
+#define CALIBRATION_RUNS 3
+#define SALT_SIZE 16
+#define HASH_SIZE 32
+
+
+extern char *argv0;
+
+
+int
+key2root_parse_memory(const char *str, uint_least32_t *kibibytesp)
+{
+	unsigned long long int n;
+	char *end;
+
+	if (!isdigit((unsigned char)*str))
+		goto einval;
+	errno = 0;
+	n = strtoull(str, &end, 10);
+	if (errno)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g': n = n > ULLONG_MAX >> 10 ? ULLONG_MAX : n << 10; /* fall through */
+	case 'M': case 'm': n = n > ULLONG_MAX >> 10 ? ULLONG_MAX : n << 10; /* fall through */
+	case 'K': case 'k': end++; break;
+	default: break;
+	}
+	if (*end)
+		goto einval;
+	if (n > UINT_LEAST32_MAX) {
+		errno = ERANGE;
+		return -1;
+	}
+	*kibibytesp = (uint_least32_t)n;
+	return 0;
+
+einval:
+	errno = EINVAL;
+	return -1;
+}
+
+
+uint_least32_t
+key2root_tune_default_memory(void)
+{
+	long int pages = sysconf(_SC_PHYS_PAGES);
+	long int pagesize = sysconf(_SC_PAGESIZE);
+	unsigned long long int quarter;
+
+	if (pages <= 0 || pagesize <= 0)
+		return DEFAULT_MAX_MEMORY;
+	quarter = (unsigned long long int)pages * (unsigned long long int)pagesize / 4 / 1024;
+	return quarter < DEFAULT_MAX_MEMORY ? (uint_least32_t)quarter : DEFAULT_MAX_MEMORY;
+}
+
+
+uint_least32_t
+key2root_tune_default_lanes(void)
+{
+	long int nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprocs <= 0)
+		return 1;
+	return nprocs < DEFAULT_MAX_LANES ? (uint_least32_t)nprocs : DEFAULT_MAX_LANES;
+}
+
+
+uint_least32_t
+key2root_tune_default_budget(void)
+{
+	long int pages = sysconf(_SC_PHYS_PAGES);
+	long int pagesize = sysconf(_SC_PAGESIZE);
+	unsigned long long int half;
+
+	if (pages <= 0 || pagesize <= 0)
+		return key2root_tune_default_memory();
+	half = (unsigned long long int)pages * (unsigned long long int)pagesize / 2 / 1024;
+	return half < UINT_LEAST32_MAX ? (uint_least32_t)half : UINT_LEAST32_MAX;
+}
+
+
+static double
+measure(uint_least32_t m_cost, uint_least32_t t_cost, uint_least32_t lanes)
+{
+	struct libar2_argon2_parameters params;
+	unsigned char salt[SALT_SIZE] = {0};
+	char msg[] = "key2root";
+	struct timespec start, end;
+	void *hash;
+	size_t size;
+
+	memset(&params, 0, sizeof(params));
+	params.type = LIBAR2_ARGON2ID;
+	params.version = LIBAR2_ARGON2_VERSION_13;
+	params.m_cost = m_cost;
+	params.t_cost = t_cost;
+	params.lanes = lanes;
+	params.salt = salt;
+	params.saltlen = sizeof(salt);
+	params.hashlen = HASH_SIZE;
+
+	size = libar2_hash_buf_size(&params);
+	hash = size ? malloc(size) : NULL;
+	if (!hash)
+		return -1;
+
+	/* The arena is released first, so that allocating and faulting
+	 * in the memory is measured, as it is in a new key2root process */
+	key2root_crypt_release();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (key2root_hash(hash, msg, sizeof(msg) - 1, &params, 0)) {
+		free(hash);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	key2root_crypt_release();
+	free(hash);
+
+	return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1000000000.;
+}
+
+
+char *
+key2root_tune(unsigned long int milliseconds, uint_least32_t max_m_cost, uint_least32_t lanes)
+{
+	double target = (double)milliseconds / 1000., time, time2, pass;
+	uint_least32_t m_cost, new_m_cost, t_cost, new_t_cost, min_m_cost, step, probe;
+	char *ret;
+
+	if (!lanes || lanes > UINT_LEAST32_MAX / 8) {
+		errno = EINVAL;
+		goto fail;
+	}
+	step = 4 * lanes;
+	min_m_cost = 2 * step;
+	m_cost = max_m_cost - max_m_cost % step;
+	if (m_cost < min_m_cost) {
+		fprintf(stderr, "%s: at least %ju KiB of memory is required for %ju lanes\n",
+		        argv0, (uintmax_t)min_m_cost, (uintmax_t)lanes);
+		return NULL;
+	}
+
+	/* Memory is preferred over passes, so the memory is set, in proportion
+	 * to the time of a smaller probe, and then reduced until a single pass
+	 * meets the target */
+	probe = m_cost < PROBE_MEMORY ? m_cost : PROBE_MEMORY - PROBE_MEMORY % step;
+	if (probe < min_m_cost)
+		probe = min_m_cost;
+	time = measure(probe, 1, lanes);
+	if (time < 0)
+		goto fail;
+	if (probe < m_cost) {
+		new_m_cost = (uint_least32_t)((double)probe * target / time * .95 < (double)m_cost
+		                              ? (double)probe * target / time * .95 : (double)m_cost);
+		new_m_cost -= new_m_cost % step;
+		m_cost = new_m_cost < min_m_cost ? min_m_cost : new_m_cost;
+		time = measure(m_cost, 1, lanes);
+	}
+	while (time > target && m_cost > min_m_cost) {
+		new_m_cost = (uint_least32_t)((double)m_cost * target / time * .95);
+		new_m_cost -= new_m_cost % step;
+		if (new_m_cost >= m_cost)
+			new_m_cost = m_cost - step;
+		m_cost = new_m_cost < min_m_cost ? min_m_cost : new_m_cost;
+		time = measure(m_cost, 1, lanes);
+	}
+	if (time < 0)
+		goto fail;
+	if (time > target) {
+		fprintf(stderr, "%s: cannot hash within %lu ms, even with %ju KiB of memory\n",
+		        argv0, milliseconds, (uintmax_t)m_cost);
+		return NULL;
+	}
+
+	/* Then remaining time is spent on additional passes, estimated
+	 * from the difference between one and two passes */
+	t_cost = 1;
+	if (m_cost == max_m_cost - max_m_cost % step) {
+		time2 = measure(m_cost, 2, lanes);
+		if (time2 < 0)
+			goto fail;
+		if (time2 <= target) {
+			pass = time2 - time > 0 ? time2 - time : time;
+			t_cost = 2 + (uint_least32_t)((target * .95 - time2 > 0 ? target * .95 - time2 : 0) / pass);
+			while (t_cost > 2 && (time = measure(m_cost, t_cost, lanes)) > target) {
+				new_t_cost = (uint_least32_t)((double)t_cost * target / time * .95);
+				t_cost = new_t_cost < 2 ? 2 : new_t_cost < t_cost ? new_t_cost : t_cost - 1;
+			}
+			if (time < 0)
+				goto fail;
+		}
+	}
+
+	ret = malloc(sizeof("$argon2id$v=19$m=,t=,p=$*16$*32") + 3 * 3 * sizeof(uintmax_t));
+	if (!ret)
+		goto fail;
+	sprintf(ret, "$argon2id$v=19$m=%ju,t=%ju,p=%ju$*%i$*%i", (uintmax_t)m_cost, (uintmax_t)t_cost,
+	        (uintmax_t)lanes, SALT_SIZE, HASH_SIZE);
+	return ret;
+
+fail:
+	fprintf(stderr, "%s: tune: %s\n", argv0, strerror(errno));
+	return NULL;
+}
+
+
+/* Measures, on one lane, the time to set up the memory and the time of
+ * a pass, per kibibyte, from the difference between one and two passes.
+ * The fastest of a few runs is used, as the others were interrupted */
+int
+key2root_calibrate(struct key2root_calibration *calibration)
+{
+	double time1 = -1, time2 = -1, time;
+	long int nprocs;
+	int i;
+
+	for (i = 0; i < CALIBRATION_RUNS; i++) {
+		time = measure(PROBE_MEMORY, 1, 1);
+		if (time < 0)
+			goto fail;
+		if (time1 < 0 || time < time1)
+			time1 = time;
+		time = measure(PROBE_MEMORY, 2, 1);
+		if (time < 0)
+			goto fail;
+		if (time2 < 0 || time < time2)
+			time2 = time;
+	}
+
+	calibration->pass = (time2 > time1 ? time2 - time1 : time1) / (double)PROBE_MEMORY;
+	calibration->setup = (time1 > time2 - time1 ? time1 - (time2 - time1) : 0) / (double)PROBE_MEMORY;
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	calibration->threads = nprocs > 1 ? (uint_least32_t)nprocs : 1;
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: calibrate: %s\n", argv0, strerror(errno));
+	return -1;
+}
+
+
+/* The lanes of a hash are computed in parallel, by as many threads
+ * as there are processors, and so is the memory initialised */
+double
+key2root_estimate(const struct key2root_calibration *calibration, uint_least32_t m_cost,
+                  uint_least32_t t_cost, uint_least32_t lanes)
+{
+	uint_least32_t threads = lanes < calibration->threads ? lanes : calibration->threads;
+
+	if (!threads)
+		threads = 1;
+	return (double)m_cost * (calibration->setup + (double)t_cost * calibration->pass) / (double)threads;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+
+struct key2root_calibration {
+	double setup; /* seconds per kibibyte to allocate and initialise the memory */
+	double pass; /* seconds per kibibyte and pass */
+	uint_least32_t threads; /* the most lanes computed at the same time */
+};
+
+int key2root_parse_memory(const char *str, uint_least32_t *kibibytesp);
+char *key2root_tune(unsigned long int milliseconds, uint_least32_t max_m_cost, uint_least32_t lanes);
+uint_least32_t key2root_tune_default_memory(void);
+uint_least32_t key2root_tune_default_lanes(void);
+uint_least32_t key2root_tune_default_budget(void);
+int key2root_calibrate(struct key2root_calibration *calibration);
+double key2root_estimate(const struct key2root_calibration *calibration, uint_least32_t m_cost,
+                         uint_least32_t t_cost, uint_least32_t lanes);